@@ -0,0 +1,548 @@
+// Micro-benchmarks of the TEXT segment map (map_lib.c) and the copy_data()
+// kernels (decode.c, simd.c), without R or any file I/O.
+//
+// Build from this directory with (leave out -fopenmp if unsupported)
+//
+//   cc -O2 -std=gnu99 -fopenmp -I../../src -o micro micro.c
+//       ../../src/decode.c ../../src/simd.c ../../src/map_lib.c
+//       ../../src/arena.c
+//
+// and run
+//
+//   ./micro [-o results.csv] [-b baseline.csv] [-t threshold] [-r reps]
+//
+// Every benchmark is run 'reps' times (default 5) and the fastest run is
+// reported, in ns per key for the map and ns per event for copy_data().  On
+// Linux the (last level) cache misses per key or event are counted as well if
+// perf events are available, otherwise they are NA.
+//
+// With -o the results are written as CSV, e.g. to keep as a baseline.  With
+// -b every benchmark is compared with the same benchmark in 'baseline.csv' (a
+// file written by -o, on the same machine) and flagged if it is more than
+// 'threshold' (default 0.10, i.e. 10%) slower, in which case the exit status
+// is 1.  Timings only compare on one machine, so no baseline is shipped: it
+// is written on the machine that runs the gate, from the tree before the
+// change.  So a change to the TEXT store or a decode kernel is checked with
+//
+//   git stash && cc ... && ./micro -o baseline.csv     # before the change
+//   git stash pop && cc ... && ./micro -b baseline.csv # after the change
+//
+// where 'cc ...' is the build command above.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "arena.h"
+#include "decode.h"
+#include "map_lib.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Least total time a run is repeated for, to get above the clock resolution.
+#define MIN_RUN_NS 20e6
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Cache miss counter of this thread, or -1 if there is none.
+static int misses_fd = -1;
+
+static void open_counter(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    misses_fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static void start_counter(void)
+{
+#ifdef __linux__
+    if (misses_fd >= 0) {
+        ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+// Misses since start_counter(), or -1 if not counted.
+static double stop_counter(void)
+{
+#ifdef __linux__
+    uint64_t n;
+    if (misses_fd >= 0) {
+        ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(misses_fd, &n, sizeof(n)) == sizeof(n))
+            return (double)n;
+    }
+#endif
+    return -1;
+}
+
+// One benchmark: 'run' does 'ops' keys or events worth of work on 'state'.
+typedef struct {
+    const char *bench;
+    char config[64];
+    const char *kernel;         // decode kernel, or "" for the map
+    void (*run)(void *state);
+    void *state;
+    double ops;
+} bench_t;
+
+typedef struct {
+    double ns, misses;          // per op, misses < 0 if not counted
+} result_t;
+
+static result_t measure(const bench_t *b, int reps)
+{
+    // Warm up, and find how many calls make a run of at least MIN_RUN_NS.
+    int calls = 1;
+    double t = now_ns();
+    b->run(b->state);
+    double once = now_ns() - t;
+    if (once < MIN_RUN_NS)
+        calls = (int)(MIN_RUN_NS / (once > 1 ? once : 1)) + 1;
+
+    result_t best = { 0, -1 };
+    for (int r = 0; r < reps; ++r) {
+        start_counter();
+        t = now_ns();
+        for (int i = 0; i < calls; ++i)
+            b->run(b->state);
+        double ns = (now_ns() - t) / (calls * b->ops);
+        double misses = stop_counter();
+        if (r == 0 || ns < best.ns) {
+            best.ns = ns;
+            best.misses = misses < 0 ? -1 : misses / (calls * b->ops);
+        }
+    }
+    return best;
+}
+
+static uint32_t rng = 1;
+
+static uint32_t next_random(void)
+{
+    rng = rng * 1103515245u + 12345u;
+    return (rng >> 8) ^ (rng << 13);
+}
+
+// Keeps the compiler from optimizing away lookups and folds.
+static volatile size_t sink;
+
+// -- map_lib -----------------------------------------------------------------
+
+// The keywords of an LXB file with 'npar' parameters and vendor keywords up to
+// 'nkeys' keywords in all, in the order the TEXT segment has them.
+typedef struct {
+    int nkeys;
+    char **keys, **values;
+    char **misses;              // keys looked up that are not in the map
+    map_t map;                  // holding all keys
+} map_state;
+
+// Arena of run_map_set_ref(), reset after every run.  It is shared by all
+// benchmarks (as the arena of a reader thread is shared by all its files) so
+// that its blocks are reused rather than leaked when a benchmark is done.
+static lxb_arena map_arena;
+
+static void add_key(map_state *s, const char *key, const char *value)
+{
+    s->keys[s->nkeys]   = strcpy(malloc(strlen(key) + 1), key);
+    s->values[s->nkeys] = strcpy(malloc(strlen(value) + 1), value);
+    ++s->nkeys;
+}
+
+static map_state *make_map_state(int nkeys, int npar)
+{
+    map_state *s = calloc(1, sizeof(map_state));
+    s->keys   = malloc(nkeys * sizeof(char *));
+    s->values = malloc(nkeys * sizeof(char *));
+    s->misses = malloc(nkeys * sizeof(char *));
+
+    static const char *std[][2] = {
+        { "$BYTEORD", "1,2,3,4" }, { "$DATATYPE", "I" }, { "$MODE", "L" },
+        { "$NEXTDATA", "0" }, { "$TOT", "12345" }, { "$BEGINDATA", "4096" },
+        { "$ENDDATA", "349755" }, { "$WELLID", "B12" }
+    };
+    char key[32], value[32];
+    snprintf(value, sizeof(value), "%d", npar);
+    add_key(s, "$PAR", value);
+    for (size_t i = 0; i < sizeof(std) / sizeof(std[0]); ++i)
+        add_key(s, std[i][0], std[i][1]);
+    for (int i = 1; i <= npar && s->nkeys + 4 <= nkeys; ++i) {
+        snprintf(key, sizeof(key), "$P%dB", i);
+        add_key(s, key, "32");
+        snprintf(key, sizeof(key), "$P%dN", i);
+        snprintf(value, sizeof(value), "CH%d", i);
+        add_key(s, key, value);
+        snprintf(key, sizeof(key), "$P%dR", i);
+        add_key(s, key, "65536");
+        snprintf(key, sizeof(key), "$P%dE", i);
+        add_key(s, key, "0,0");
+    }
+    while (s->nkeys < nkeys) {
+        snprintf(key, sizeof(key), "VENDOR_KEY_%d", s->nkeys);
+        snprintf(value, sizeof(value), "value_%u", next_random());
+        add_key(s, key, value);
+    }
+    for (int i = 0; i < nkeys; ++i) {
+        snprintf(key, sizeof(key), "$P%dX", i + 1);
+        s->misses[i] = strcpy(malloc(strlen(key) + 1), key);
+    }
+
+    s->map = map_create();
+    for (int i = 0; i < nkeys; ++i)
+        map_set(s->map, s->keys[i], s->values[i]);
+    return s;
+}
+
+static void free_map_state(void *state)
+{
+    map_state *s = state;
+    for (int i = 0; i < s->nkeys; ++i) {
+        free(s->keys[i]);
+        free(s->values[i]);
+        free(s->misses[i]);
+    }
+    free(s->keys);
+    free(s->values);
+    free(s->misses);
+    map_free(s->map);
+    free(s);
+}
+
+// map_set() copying every key, as map_create() users do.
+static void run_map_set(void *state)
+{
+    map_state *s = state;
+    map_t m = map_create();
+    for (int i = 0; i < s->nkeys; ++i)
+        map_set(m, s->keys[i], s->values[i]);
+    map_free(m);
+}
+
+// map_set_ref() into an arena, as parse_text() does.
+static void run_map_set_ref(void *state)
+{
+    map_state *s = state;
+    map_t m = map_create_in(&map_arena, s->nkeys);
+    for (int i = 0; i < s->nkeys; ++i)
+        map_set_ref(m, s->keys[i], s->values[i]);
+    map_free(m);
+    arena_reset(&map_arena);
+}
+
+static void run_map_get(void *state)
+{
+    map_state *s = state;
+    size_t n = 0;
+    for (int i = 0; i < s->nkeys; ++i)
+        n += (size_t)map_get(s->map, s->keys[i]);
+    sink = n;
+}
+
+static void run_map_get_miss(void *state)
+{
+    map_state *s = state;
+    size_t n = 0;
+    for (int i = 0; i < s->nkeys; ++i)
+        n += (size_t)map_get(s->map, s->misses[i]);
+    sink = n;
+}
+
+static void count_key(const char *key, const char *value, void *state)
+{
+    *(size_t *)state += (size_t)key[0] + (size_t)value[0];
+}
+
+static void run_map_fold(void *state)
+{
+    map_state *s = state;
+    size_t n = 0;
+    map_fold(s->map, count_key, &n);
+    sink = n;
+}
+
+// -- copy_data ---------------------------------------------------------------
+
+typedef struct {
+    decode_plan plan;
+    map_t txt;
+    char *src;
+    void *dest;
+} copy_state;
+
+// Plan for 'ntot' events of 'npar' parameters whose widths cycle through the
+// 'nbits' widths in 'bits', with random data.
+static copy_state *make_copy_state(const int *bits, int nbits, int npar,
+        int ntot, bool swap)
+{
+    copy_state *s = calloc(1, sizeof(copy_state));
+    char key[32], value[32];
+    s->txt = map_create();
+    map_set(s->txt, "$BYTEORD", swap != HOST_BIG_ENDIAN ? "4,3,2,1"
+            : "1,2,3,4");
+    map_set(s->txt, "$DATATYPE", "I");
+    snprintf(value, sizeof(value), "%d", npar);
+    map_set(s->txt, "$PAR", value);
+    snprintf(value, sizeof(value), "%d", ntot);
+    map_set(s->txt, "$TOT", value);
+    for (int i = 1; i <= npar; ++i) {
+        int b = bits[(i - 1) % nbits];
+        snprintf(key, sizeof(key), "$P%dB", i);
+        snprintf(value, sizeof(value), "%d", b);
+        map_set(s->txt, key, value);
+        snprintf(key, sizeof(key), "$P%dN", i);
+        snprintf(value, sizeof(value), "CH%d", i);
+        map_set(s->txt, key, value);
+        snprintf(key, sizeof(key), "$P%dR", i);
+        snprintf(value, sizeof(value), "%.0f", b < 20 ? (double)(1 << b)
+                : 1048576.0);
+        map_set(s->txt, key, value);
+    }
+
+    if (!describe_parameters(&s->plan, s->txt)
+            || !make_plan(&s->plan, NULL, 0)) {
+        fprintf(stderr, "micro: out of memory\n");
+        exit(2);
+    }
+
+    size_t size = (size_t)s->plan.stride * ntot;
+    s->src = malloc(size);
+    s->dest = malloc((size_t)s->plan.ncol * ntot * output_size(&s->plan));
+    if (!s->src || !s->dest) {
+        fprintf(stderr, "micro: out of memory\n");
+        exit(2);
+    }
+    for (size_t i = 0; i < size; ++i)
+        s->src[i] = (char)next_random();
+
+    return s;
+}
+
+static void free_copy_state(void *state)
+{
+    copy_state *s = state;
+    free_plan(&s->plan);
+    map_free(s->txt);
+    free(s->src);
+    free(s->dest);
+    free(s);
+}
+
+static void run_copy_data(void *state)
+{
+    copy_state *s = state;
+    copy_data(s->dest, s->src, &s->plan);
+}
+
+// -- baseline ----------------------------------------------------------------
+
+typedef struct {
+    char bench[32], config[64];
+    double ns;
+} baseline_row;
+
+// Read the bench, config and ns columns of a file written by -o.  Returns the
+// number of rows, or -1 if 'path' cannot be read.
+static int read_baseline(const char *path, baseline_row **rows)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    int n = 0, cap = 64;
+    char line[256];
+    *rows = malloc(cap * sizeof(baseline_row));
+    if (!fgets(line, sizeof(line), fp))     // header
+        n = -1;
+    while (n >= 0 && fgets(line, sizeof(line), fp)) {
+        if (n == cap)
+            *rows = realloc(*rows, (cap *= 2) * sizeof(baseline_row));
+        baseline_row *r = &(*rows)[n];
+        if (sscanf(line, "%31[^,],%63[^,],%*[^,],%lf", r->bench, r->config,
+                    &r->ns) == 3)
+            ++n;
+    }
+    fclose(fp);
+    return n;
+}
+
+static const baseline_row *find_baseline(const baseline_row *rows, int n,
+        const bench_t *b)
+{
+    for (int i = 0; i < n; ++i) {
+        if (strcmp(rows[i].bench, b->bench) == 0
+                && strcmp(rows[i].config, b->config) == 0)
+            return &rows[i];
+    }
+    return NULL;
+}
+
+// -- main --------------------------------------------------------------------
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: micro [-o results.csv] [-b baseline.csv] "
+            "[-t threshold] [-r reps]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_path = NULL, *base_path = NULL;
+    double threshold = 0.10;
+    int reps = 5;
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 == argc)
+            usage();
+        if (strcmp(argv[i], "-o") == 0)
+            out_path = argv[++i];
+        else if (strcmp(argv[i], "-b") == 0)
+            base_path = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0)
+            threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0)
+            reps = atoi(argv[++i]);
+        else
+            usage();
+    }
+    if (reps < 1)
+        usage();
+
+    baseline_row *base = NULL;
+    int nbase = 0;
+    if (base_path && (nbase = read_baseline(base_path, &base)) < 0) {
+        fprintf(stderr, "micro: cannot read '%s' (write it with -o first)\n",
+                base_path);
+        return 2;
+    }
+
+    FILE *out = NULL;
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        fprintf(stderr, "micro: cannot write '%s'\n", out_path);
+        return 2;
+    }
+    if (out)
+        fprintf(out, "bench,config,kernel,ns,misses\n");
+
+    open_counter();
+    printf("%-12s %-36s %-12s %10s %10s %8s\n", "bench", "config", "kernel",
+           "ns/op", "misses/op", "change");
+
+    // A typical LXB file has around 50 keywords, some instruments write
+    // thousands of vendor keywords.
+    static const int key_counts[] = { 50, 500, 5000 };
+    static const struct {
+        const char *name;
+        void (*run)(void *);
+    } map_benches[] = {
+        { "map_set", run_map_set }, { "map_set_ref", run_map_set_ref },
+        { "map_get", run_map_get }, { "map_get_miss", run_map_get_miss },
+        { "map_fold", run_map_fold }
+    };
+
+    // Bit width mixes, with the parameter and event counts each is run at.
+    static const struct {
+        const char *name;
+        int bits[3], nbits;
+        bool swap;
+    } mixes[] = {
+        { "32", { 32 }, 1, false }, { "16", { 16 }, 1, false },
+        { "8", { 8 }, 1, false }, { "32/16/8", { 32, 16, 8 }, 3, false },
+        { "64", { 64 }, 1, false }, { "32swap", { 32 }, 1, true },
+        { "32/16/8swap", { 32, 16, 8 }, 3, true }
+    };
+    static const int par_counts[] = { 7, 16, 32 };
+    static const int event_counts[] = { 10000, 100000, 1000000 };
+
+    int nbench = 0, nslower = 0;
+    size_t nkey = sizeof(key_counts) / sizeof(key_counts[0]);
+    size_t nmap = sizeof(map_benches) / sizeof(map_benches[0]);
+    size_t nmix = sizeof(mixes) / sizeof(mixes[0]);
+    size_t npars = sizeof(par_counts) / sizeof(par_counts[0]);
+    size_t nevents = sizeof(event_counts) / sizeof(event_counts[0]);
+    size_t total = nkey * nmap + nmix * npars * nevents;
+    for (size_t k = 0; k < total; ++k) {
+        bench_t b;
+        void (*free_state)(void *);
+        if (k < nkey * nmap) {
+            int nkeys = key_counts[k / nmap];
+            b.bench  = map_benches[k % nmap].name;
+            b.kernel = "";
+            b.run    = map_benches[k % nmap].run;
+            b.state  = make_map_state(nkeys, 7);
+            b.ops    = nkeys;
+            snprintf(b.config, sizeof(b.config), "keys=%d", nkeys);
+            free_state = free_map_state;
+        } else {
+            size_t j = k - nkey * nmap;
+            int mix  = (int)(j / (npars * nevents));
+            int npar = par_counts[j / nevents % npars];
+            int ntot = event_counts[j % nevents];
+            copy_state *s = make_copy_state(mixes[mix].bits,
+                    mixes[mix].nbits, npar, ntot, mixes[mix].swap);
+            b.bench  = "copy_data";
+            b.kernel = s->plan.kernel_name ? s->plan.kernel_name : "";
+            b.run    = run_copy_data;
+            b.state  = s;
+            b.ops    = ntot;
+            snprintf(b.config, sizeof(b.config), "bits=%s par=%d events=%d",
+                     mixes[mix].name, npar, ntot);
+            free_state = free_copy_state;
+        }
+
+        result_t r = measure(&b, reps);
+        free_state(b.state);
+        ++nbench;
+
+        char change[16] = "";
+        const baseline_row *old = find_baseline(base, nbase, &b);
+        if (old && old->ns > 0) {
+            double rel = r.ns / old->ns - 1;
+            snprintf(change, sizeof(change), "%+.1f%%", 100 * rel);
+            if (rel > threshold)
+                ++nslower;
+        }
+        char misses[16] = "NA";
+        if (r.misses >= 0)
+            snprintf(misses, sizeof(misses), "%.3f", r.misses);
+        printf("%-12s %-36s %-12s %10.3f %10s %8s%s\n", b.bench, b.config,
+               b.kernel, r.ns, misses, change,
+               old && r.ns > old->ns * (1 + threshold) ? "  SLOWER" : "");
+        fflush(stdout);
+        if (out)
+            fprintf(out, "%s,%s,%s,%.4f,%s\n", b.bench, b.config, b.kernel,
+                    r.ns, misses);
+    }
+
+    if (out)
+        fclose(out);
+    free(base);
+    if (base_path) {
+        printf("%d of %d benchmarks more than %.0f%% slower than '%s'\n",
+               nslower, nbench, 100 * threshold, base_path);
+        return nslower > 0;
+    }
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "arena.h"
+
+// Every thread reading files has an arena that all memory for parsing and
+// planning its files comes from: the TEXT segment tokens and keyword map, the
+// decode plan and the rows kept by the filters.  None of it outlives the call
+// into the reader, so instead of being freed file by file it is all released
+// by reset_arenas() when the next call starts.
+//
+// An arena grows by adding blocks, which are all kept (up to ARENA_KEEP bytes)
+// when it is reset.  After the first call each thread therefore only bumps a
+// pointer through memory it has touched before.  Only the thread an arena
+// belongs to allocates from it, but memory may be freed on any thread.  Files
+// that are kept open between calls (see stream.c) have no arena, i.e. use
+// malloc().
+
+// Alignment of every allocation, enough for any type.
+#define ARENA_ALIGN 16
+// Size of the first block of an arena.
+#define ARENA_BLOCK (256 * 1024)
+// Max total size of the blocks kept by arena_reset(), the rest is given back.
+#define ARENA_KEEP  (64 * 1024 * 1024)
+
+typedef struct arena_block_s {
+    struct arena_block_s *next;
+    size_t size, used;
+} arena_block;
+
+// One arena per OpenMP thread, see reset_arenas().
+static lxb_arena *arenas = NULL;
+static int narenas = 0;
+
+static size_t align(size_t n)
+{
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static char *block_data(arena_block *b)
+{
+    return (char *)b + align(sizeof(arena_block));
+}
+
+static arena_block *new_block(size_t size)
+{
+    arena_block *b = (arena_block *)malloc(align(sizeof(arena_block)) + size);
+    if (b) {
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+    }
+    return b;
+}
+
+void *arena_alloc(lxb_arena *arena, size_t size)
+{
+    if (!arena)
+        return malloc(size > 0 ? size : 1);
+
+    size = align(size > 0 ? size : 1);
+    arena_block *b = arena->cur;
+    if (!b || b->size - b->used < size) {
+        // Move on to the next block, whatever is left of this one is wasted
+        // until the reset.  A block too small is skipped for this call.
+        while (b && b->next && b->next->size < size)
+            b = b->next;
+        if (b && b->next) {
+            b = b->next;
+        } else {
+            size_t want = b ? 2 * b->size : ARENA_BLOCK;
+            arena_block *nb = new_block(want > size ? want : size);
+            if (!nb)
+                return NULL;
+            if (b)
+                b->next = nb;
+            else
+                arena->blocks = nb;
+            b = nb;
+        }
+        arena->cur = b;
+    }
+
+    void *p = block_data(b) + b->used;
+    b->used += size;
+    arena->used += size;
+    arena->total += size;
+    ++arena->count;
+    arena->last = p;
+    return p;
+}
+
+void *arena_calloc(lxb_arena *arena, size_t size)
+{
+    void *p = arena_alloc(arena, size);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+void *arena_realloc(lxb_arena *arena, void *p, size_t old_size, size_t size)
+{
+    if (!arena)
+        return realloc(p, size > 0 ? size : 1);
+
+    // Grow the last allocation in place if its block has room.
+    arena_block *b = arena->cur;
+    if (p && p == arena->last) {
+        size_t start = (char *)p - block_data(b);
+        size_t end = start + align(size > 0 ? size : 1);
+        if (end <= b->size) {
+            arena->total += end - b->used;
+            ++arena->count;
+            arena->used += end - b->used;
+            b->used = end;
+            return p;
+        }
+    }
+
+    void *q = arena_alloc(arena, size);
+    if (q && p)
+        memcpy(q, p, old_size < size ? old_size : size);
+    return q;
+}
+
+void arena_free(lxb_arena *arena, void *p)
+{
+    if (!arena) {
+        free(p);
+        return;
+    }
+
+    // Nothing was alloc'ed after the last allocation so it can be undone, but
+    // only by the thread the arena belongs to (files may be freed elsewhere).
+    // Ownership is checked first: the fields of another thread's arena may be
+    // written while we look, so they must not even be read.
+    if (arena == thread_arena() && p && p == arena->last) {
+        arena_block *b = arena->cur;
+        size_t start = (char *)p - block_data(b);
+        arena->used -= b->used - start;
+        b->used = start;
+        arena->last = NULL;
+    }
+}
+
+arena_mark arena_usage(const lxb_arena *arena)
+{
+    arena_mark m = { 0, 0 };
+    if (arena) {
+        m.bytes = arena->total;
+        m.count = arena->count;
+    }
+    return m;
+}
+
+void arena_reset(lxb_arena *arena)
+{
+    // Keep the blocks in the order they were used, as long as they fit.
+    size_t total = 0;
+    arena_block **link = &arena->blocks;
+    while (*link) {
+        arena_block *b = *link;
+        total += b->size;
+        if (total > ARENA_KEEP && b != arena->blocks) {
+            *link = b->next;
+            free(b);
+        } else {
+            b->used = 0;
+            link = &b->next;
+        }
+    }
+
+    arena->cur = arena->blocks;
+    arena->used = 0;
+    arena->total = 0;
+    arena->count = 0;
+    arena->last = NULL;
+}
+
+lxb_arena *thread_arena(void)
+{
+    int i = 0;
+#ifdef _OPENMP
+    i = omp_get_thread_num();
+#endif
+    return i < narenas ? &arenas[i] : NULL;
+}
+
+void reset_arenas(void)
+{
+    int n = 1;
+#ifdef _OPENMP
+    n = omp_get_max_threads();
+#endif
+    if (n > narenas) {
+        // Threads without an arena (if this fails) fall back on malloc().
+        lxb_arena *a = (lxb_arena *)realloc(arenas, n * sizeof(lxb_arena));
+        if (a) {
+            memset(a + narenas, 0, (n - narenas) * sizeof(lxb_arena));
+            arenas = a;
+            narenas = n;
+        }
+    }
+
+    for (int i = 0; i < narenas; ++i)
+        arena_reset(&arenas[i]);
+}
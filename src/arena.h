@@ -0,0 +1,49 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Memory handed out by bumping a pointer and released all at once, so that
+// reading thousands of files reuses the same few blocks instead of going
+// through malloc() and free() (and fresh pages) for every file.  See arena.c.
+struct arena_block_s;
+
+typedef struct {
+    struct arena_block_s *blocks;   // in the order they are used
+    struct arena_block_s *cur;      // block alloc'ed from
+    size_t used;                    // bytes alloc'ed in all blocks
+    size_t total;                   // same but not lowered by arena_free()
+    size_t count;                   // allocations since reset (and growths)
+    void  *last;                    // last allocation, see arena_free()
+} lxb_arena;
+
+// Alloc 'size' bytes (aligned as for malloc()) from 'arena', or with malloc()
+// if 'arena' is NULL.  Returns NULL if out of memory.
+void *arena_alloc(lxb_arena *arena, size_t size);
+// Same as arena_alloc() but zeroed.
+void *arena_calloc(lxb_arena *arena, size_t size);
+// Same as realloc(), 'old_size' is the size 'p' was alloc'ed with.
+void *arena_realloc(lxb_arena *arena, void *p, size_t old_size, size_t size);
+// Same as free().  Arena memory is only reused right away if 'p' is the last
+// allocation, otherwise it is released by arena_reset().
+void arena_free(lxb_arena *arena, void *p);
+// What was alloc'ed from an arena since it was last reset, see arena_usage().
+typedef struct {
+    size_t bytes;   // counting those freed since too
+    size_t count;   // number of allocations (growing one in place counts too)
+} arena_mark;
+
+// What was alloc'ed from 'arena' since it was last reset (nothing if 'arena'
+// is NULL).
+arena_mark arena_usage(const lxb_arena *arena);
+// Release everything alloc'ed from 'arena' at once, keeping (most of) its
+// memory for reuse.
+void arena_reset(lxb_arena *arena);
+
+// Arena of the calling (OpenMP) thread for the current call into the reader.
+lxb_arena *thread_arena(void);
+// Release the arenas of all threads, main thread only.  Called when a reader
+// starts, so nothing alloc'ed from an arena may outlive the call.
+void reset_arenas(void);
+
+#endif
@@ -0,0 +1,479 @@
+#include <limits.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "lxb.h"
+
+// Number of files to prefetch per thread ahead of those being read.
+#define PREFETCH_DEPTH 2
+
+// Max number of files per thread read in one round by read_lxb_batch().  Kept
+// small so that progress is reported (and interrupts are checked) often, even
+// when a whole plate is read.
+#define ROUND_FILES 4
+
+int thread_limit(int threads)
+{
+    int n = 1;
+#ifdef _OPENMP
+    n = omp_get_max_threads();
+#endif
+    return threads > 0 && threads < n ? threads : n;
+}
+
+int thread_count(const lxb_opts *opts)
+{
+    return thread_limit(opts->threads);
+}
+
+int threads_arg(SEXP inThreads)
+{
+    return isNull(inThreads) ? 0 : asInteger(inThreads);
+}
+
+// Load all files on a pool of threads (step 1 below).
+//
+// While the threads parse and filter file i the OS is already fetching the
+// next files in the background, so that on slow (network) file systems the
+// time spent waiting on I/O overlaps with decoding instead of adding to it.
+void load_files(lxb_file *files, int n, const lxb_opts *opts)
+{
+    int nthreads = thread_count(opts);
+    int depth = PREFETCH_DEPTH * nthreads;
+
+    // The first 'nthreads' files are read right away, prefetch the rest of
+    // the queue before any thread starts blocking on them.
+    for (int i = nthreads; i < depth && i < n; ++i)
+        prefetch_file(files[i].filename);
+
+    // Files are handed out one at a time in order, so when file i is taken
+    // the files before i + depth have been prefetched already.
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+    for (int i = 0; i < n; ++i) {
+        if (i + depth < n)
+            prefetch_file(files[i + depth].filename);
+        files[i].arena = thread_arena();
+        double t = stats_start();
+        arena_mark mark = arena_usage(files[i].arena);
+        bool hit = cache_load(&files[i], opts);
+        stats_stop(&files[i].stats, PHASE_CACHE, t);
+        stats_arena(&files[i].stats, PHASE_CACHE, files[i].arena, mark);
+        if (hit) {
+            lxb_cache *c = &files[i].cache;
+            files[i].stats.bytes = c->buf_size;
+            stats_alloc(&files[i].stats, PHASE_CACHE, 1, c->buf_size);
+            if (opts->compact && !c->real)
+                files[i].compact = compact_data_width((const int *)c->data,
+                        (size_t)c->nrow * c->ncol);
+        } else {
+            load_file(&files[i], opts);
+        }
+    }
+}
+
+// Copy (step 3 below) the cached data of each of the 'n' files, or decode it
+// if it was not cached and add it to the cache, into the output 'dest'
+// allocated for it, and free the files.  Cache hits that are mapped as the
+// output have no 'dest' and are only freed.
+static void decode_files(lxb_file *files, void **dest, int n,
+        const lxb_opts *opts)
+{
+#pragma omp parallel for schedule(dynamic) num_threads(thread_count(opts))
+    for (int i = 0; i < n; ++i) {
+        lxb_cache *c = &files[i].cache;
+        double t = stats_start();
+        size_t size = (size_t)c->ncol * c->nrow;
+        if (dest[i] && c->data && files[i].compact) {
+            narrow_ints(dest[i], (const int *)c->data, size,
+                    files[i].compact);
+            files[i].stats.events = c->nrow;
+            stats_stop(&files[i].stats, PHASE_CACHE, t);
+        } else if (dest[i] && c->data) {
+            memcpy(dest[i], c->data, size
+                    * (c->real ? sizeof(double) : sizeof(int)));
+            files[i].stats.events = c->nrow;
+            stats_stop(&files[i].stats, PHASE_CACHE, t);
+        } else if (dest[i]) {
+            decode_file(&files[i], dest[i]);
+            t = stats_start();
+            cache_store(&files[i], opts, dest[i]);
+            stats_stop(&files[i].stats, PHASE_CACHE, t);
+        }
+        free_file(&files[i]);
+    }
+}
+
+// End of the round of files starting at 'first': at most ROUND_FILES per
+// thread, taking up at most 'buffer' bytes (but at least one file).
+static int round_end(const lxb_file *files, int first, int n, int nthreads,
+        double buffer)
+{
+    int last = n - first > ROUND_FILES * nthreads
+        ? first + ROUND_FILES * nthreads : n;
+    if (!R_FINITE(buffer))
+        return last;
+
+    double bytes = 0;
+    for (int i = first; i < last; ++i) {
+        int64_t size, mtime;
+        if (file_stat(files[i].filename, &size, &mtime))
+            bytes += (double)size;
+        if (bytes > buffer && i > first)
+            return i;
+    }
+    return last;
+}
+
+// Call 'callback' (if not NULL) with the number of files read so far and
+// the total.
+static void report_progress(SEXP callback, int done, int n)
+{
+    if (isNull(callback))
+        return;
+
+    SEXP sdone, sn, call;
+    PROTECT(sdone = ScalarInteger(done));
+    PROTECT(sn = ScalarInteger(n));
+    PROTECT(call = lang3(callback, sdone, sn));
+    eval(call, R_GlobalEnv);
+    UNPROTECT(3);
+}
+
+// Read many LXB files at once.
+//
+// Reading, parsing and decoding run on a pool of OpenMP threads whereas all R
+// objects are allocated on the main thread in between:
+//
+//   1. (parallel) look up every file in the cache, or read and parse it and
+//                 filter events
+//   2. (serial)   allocate output for every file, emit warnings
+//   3. (parallel) copy_data() (or the cached data) into the output allocated
+//                 in step 2, add files that were not cached to the cache
+//
+// The files go through these steps in rounds of (at most) ROUND_FILES per
+// thread, and of at most 'inBuffer' bytes of files, so that no more than that
+// is held in memory (besides the output) at a time.  Nothing but the output is
+// left of a round once it is done, so in between rounds the 'inProgress'
+// callback (if not NULL) is called with the number of files read so far and
+// the total, and the user may interrupt the read.  At most 'inThreads' threads
+// are used if it is not NULL.
+//
+// Returns a list with one item per filename, each item being the same as what
+// read_lxb() returns for that file.  'inCacheDir' is the directory of the
+// cache, or NULL to not use it.  The cache is never used if 'inTextFlag' is set.
+//
+// If 'inCompact' is set then integer matrices are stored in as few bytes per
+// value as their columns need, see compact.c.  If 'inLazy' is set then files
+// that are not cached are decoded column by column as R reads them instead,
+// see lazy.c.
+//
+// If 'inNames' is not NULL then the list is named and ordered by well as given
+// by the $WELLID of each file, or else its name in 'inNames' (see wells.c).
+// Its "order" attribute then holds the (1-based) index of the file of each
+// item.  The "wells" attribute always holds the $WELLID of each item (NA if
+// the file has none).
+SEXP read_lxb_batch(SEXP inFilenames, SEXP inTextFlag, SEXP inColumns,
+        SEXP inFilter, SEXP inGates, SEXP inCacheDir, SEXP inNames,
+        SEXP inCompact, SEXP inLazy, SEXP inThreads, SEXP inBuffer,
+        SEXP inProgress)
+{
+    int n = LENGTH(inFilenames);
+    int textFlag = *LOGICAL(inTextFlag);
+    lxb_opts opts;
+    get_opts(&opts, inColumns, inFilter, inGates);
+    if (!isNull(inCacheDir) && !textFlag)
+        opts.cache_dir = CHAR(STRING_ELT(inCacheDir, 0));
+    opts.compact = *LOGICAL(inCompact);
+    opts.lazy    = *LOGICAL(inLazy);
+    opts.threads = threads_arg(inThreads);
+    double buffer = asReal(inBuffer);
+
+    lxb_file *files = (lxb_file *)R_alloc(n, sizeof(lxb_file));
+    void **dest = (void **)R_alloc(n, sizeof(void *));
+    memset(files, 0, n * sizeof(lxb_file));
+    for (int i = 0; i < n; ++i)
+        files[i].filename = CHAR(STRING_ELT(inFilenames, i));
+
+    // Output of file i, and its $WELLID (which outlives the file).
+    SEXP items;
+    PROTECT(items = allocVector(VECSXP, n));
+    const char **ids = (const char **)R_alloc(n + 1, sizeof(char *));
+    int nthreads = thread_count(&opts);
+    for (int first = 0, last; first < n; first = last) {
+        last = round_end(files, first, n, nthreads, buffer);
+
+        reset_arenas();
+        // File sizes vary so hand out files to threads one at a time.
+        load_files(files + first, last - first, &opts);
+
+        for (int i = first; i < last; ++i) {
+            const char *id = file_well_id(&files[i]);
+            ids[i] = id ? strcpy(R_alloc(strlen(id) + 1, 1), id) : NULL;
+            flush_log(&files[i].log);
+            SET_VECTOR_ELT(items, i, alloc_output(&files[i], textFlag,
+                        &dest[i]));
+        }
+
+        // Fetch the start of the next round while this one is decoded, as
+        // load_files() does within a round.
+        for (int i = last; i < last + nthreads && i < n; ++i)
+            prefetch_file(files[i].filename);
+        decode_files(files + first, dest + first, last - first, &opts);
+
+        report_progress(inProgress, last, n);
+        if (last < n)
+            R_CheckUserInterrupt();
+    }
+
+    // Item k of the output is file pos[k].
+    int *pos = (int *)R_alloc(n + 1, sizeof(int));
+    for (int i = 0; i < n; ++i)
+        pos[i] = i;
+
+    SEXP out, names = R_NilValue;
+    PROTECT(out = allocVector(VECSXP, n));
+    if (!isNull(inNames)) {
+        const char **filenames = (const char **)R_alloc(n + 1,
+                sizeof(char *));
+        for (int i = 0; i < n; ++i)
+            filenames[i] = CHAR(STRING_ELT(inNames, i));
+        names = well_names(filenames, ids, n, pos);
+    }
+    PROTECT(names);
+    for (int k = 0; k < n; ++k)
+        SET_VECTOR_ELT(out, k, VECTOR_ELT(items, pos[k]));
+
+    SEXP wells;
+    PROTECT(wells = allocVector(STRSXP, n));
+    for (int k = 0; k < n; ++k)
+        SET_STRING_ELT(wells, k, ids[pos[k]] ? mkChar(ids[pos[k]])
+                : NA_STRING);
+    setAttrib(out, install("wells"), wells);
+
+    if (!isNull(names)) {
+        SEXP outnames, order;
+        PROTECT(outnames = allocVector(STRSXP, n));
+        PROTECT(order = allocVector(INTSXP, n));
+        for (int k = 0; k < n; ++k) {
+            SET_STRING_ELT(outnames, k, STRING_ELT(names, pos[k]));
+            INTEGER(order)[k] = pos[k] + 1;
+        }
+        namesgets(out, outnames);
+        setAttrib(out, install("order"), order);
+        UNPROTECT(2);
+    }
+
+    stats_record(files, n);
+    UNPROTECT(4);
+
+    return out;
+}
+
+// Read the TEXT segment of many LXB files without touching their DATA, on
+// at most 'inThreads' threads if it is not NULL.
+//
+// Returns a list with one named character vector of keywords per filename,
+// or NULL for files that could not be read.
+SEXP read_lxb_text(SEXP inFilenames, SEXP inThreads)
+{
+    int n = LENGTH(inFilenames);
+    const char **names = (const char **)R_alloc(n, sizeof(const char *));
+    map_t *txt = (map_t *)R_alloc(n, sizeof(map_t));
+    lxb_log *log = (lxb_log *)R_alloc(n, sizeof(lxb_log));
+    memset(log, 0, n * sizeof(lxb_log));
+    for (int i = 0; i < n; ++i)
+        names[i] = CHAR(STRING_ELT(inFilenames, i));
+
+    reset_arenas();
+    int nthreads = thread_limit(threads_arg(inThreads));
+    // Mostly waiting on the file system so overlap as many reads as possible.
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+    for (int i = 0; i < n; ++i)
+        txt[i] = load_text(names[i], thread_arena(), &log[i]);
+
+    SEXP out;
+    PROTECT(out = allocVector(VECSXP, n));
+    for (int i = 0; i < n; ++i) {
+        flush_log(&log[i]);
+        if (txt[i]) {
+            SET_VECTOR_ELT(out, i, map_to_Rlist(txt[i]));
+            UNPROTECT(2);
+            map_free(txt[i]);
+        }
+    }
+
+    UNPROTECT(1);
+
+    return out;
+}
+
+bool same_columns(const decode_plan *a, const decode_plan *b)
+{
+    if (a->ncol != b->ncol || a->real != b->real)
+        return false;
+    for (int k = 0; k < a->ncol; ++k) {
+        if (strcmp(a->par[a->col[k]].name, b->par[b->col[k]].name) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+const decode_plan *layout_plate(lxb_file *files, int n, const int *pos,
+        R_xlen_t *first, R_xlen_t *nrow)
+{
+    const decode_plan *ref = NULL;
+    *nrow = 0;
+    for (int k = 0; k < n; ++k) {
+        int i = pos[k];
+        lxb_file *f = &files[i];
+        if (f->data && !ref)
+            ref = &f->plan;
+        if (f->data && !same_columns(ref, &f->plan)) {
+            lxb_warn(&f->log, "  Columns of '%s' do not match those of "
+                    "the first file, skipped\n", f->filename);
+            free_plan(&f->plan);
+            f->data = NULL;
+        }
+        flush_log(&f->log);
+
+        first[i] = *nrow;
+        if (f->data)
+            *nrow += f->plan.nrow;
+    }
+
+    return ref;
+}
+
+void decode_plate(lxb_file *files, int n, const int *slot,
+        const R_xlen_t *first, R_xlen_t nrow, bool real, void *dest,
+        const lxb_opts *opts)
+{
+#pragma omp parallel for schedule(dynamic) num_threads(thread_count(opts))
+    for (int i = 0; i < n; ++i) {
+        lxb_file *f = &files[i];
+        if (f->data) {
+            for (int j = 0; j < f->plan.nrow; ++j) {
+                if (real)
+                    ((double *)dest)[first[i] + j] = slot[i] + 1;
+                else
+                    ((int *)dest)[first[i] + j] = slot[i] + 1;
+            }
+            f->plan.ld = (int)nrow;
+            decode_file(f, output_at(dest, &f->plan, nrow + first[i]));
+        }
+        free_file(&files[i]);
+    }
+}
+
+// Read many LXB files into one matrix, e.g. all wells of a plate.
+//
+// Files are ordered by well, as for read_lxb_batch(), and the events of each
+// file follow those of the previous file.  The first column, "well", holds the
+// (1-based) index in the "wells" attribute of the file each event came from,
+// which holds the well (or file) names in order.  The other columns are those
+// of the first file that could be read, files with other columns are skipped
+// with a warning.  Each file is decoded straight into its rows of the output
+// so there is no copying afterwards.  At most 'inThreads' threads are used if
+// it is not NULL.
+//
+// All files are held in memory until the output is allocated, so unlike
+// read_lxb_batch() there are no rounds to report progress (or be interrupted)
+// in between.
+//
+// Returns NULL if no file could be read.
+SEXP read_lxb_plate(SEXP inFilenames, SEXP inColumns, SEXP inFilter,
+        SEXP inGates, SEXP inThreads)
+{
+    int n = LENGTH(inFilenames);
+    lxb_opts opts;
+    get_opts(&opts, inColumns, inFilter, inGates);
+    opts.threads = threads_arg(inThreads);
+
+    lxb_file *files = (lxb_file *)R_alloc(n, sizeof(lxb_file));
+    R_xlen_t *first = (R_xlen_t *)R_alloc(n, sizeof(R_xlen_t));
+    memset(files, 0, n * sizeof(lxb_file));
+    for (int i = 0; i < n; ++i)
+        files[i].filename = CHAR(STRING_ELT(inFilenames, i));
+
+    reset_arenas();
+    load_files(files, n, &opts);
+
+    // File pos[k] is the k:th well, and slot[pos[k]] = k.
+    int *pos = (int *)R_alloc(n + 1, sizeof(int));
+    int *slot = (int *)R_alloc(n + 1, sizeof(int));
+    const char **filenames = (const char **)R_alloc(n + 1, sizeof(char *));
+    const char **ids = (const char **)R_alloc(n + 1, sizeof(char *));
+    for (int i = 0; i < n; ++i) {
+        filenames[i] = files[i].filename;
+        ids[i] = file_well_id(&files[i]);
+    }
+    SEXP names;
+    PROTECT(names = well_names(filenames, ids, n, pos));
+    for (int k = 0; k < n; ++k)
+        slot[pos[k]] = k;
+
+    // Lay out the files one after another, starting at row first[i].
+    R_xlen_t nrow;
+    const decode_plan *ref = layout_plate(files, n, pos, first, &nrow);
+
+    if (!ref || nrow > INT_MAX) {
+        if (ref)
+            warning("Too many events to fit in one matrix\n");
+        for (int i = 0; i < n; ++i)
+            free_file(&files[i]);
+        stats_record(files, n);
+        UNPROTECT(1);
+        return R_NilValue;
+    }
+
+    int ncol = ref->ncol;
+    double t = stats_start();
+    SEXP mat;
+    PROTECT(mat = allocMatrix(ref->real ? REALSXP : INTSXP, (int)nrow,
+                ncol + 1));
+
+    SEXP colnames;
+    PROTECT(colnames = allocVector(STRSXP, ncol + 1));
+    SET_STRING_ELT(colnames, 0, mkChar("well"));
+    for (int k = 0; k < ncol; ++k)
+        SET_STRING_ELT(colnames, k + 1, mkChar(ref->par[ref->col[k]].name));
+
+    SEXP dimnames;
+    PROTECT(dimnames = allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, R_NilValue);
+    SET_VECTOR_ELT(dimnames, 1, colnames);
+    dimnamesgets(mat, dimnames);
+
+    SEXP wells;
+    PROTECT(wells = allocVector(STRSXP, n));
+    for (int k = 0; k < n; ++k)
+        SET_STRING_ELT(wells, k, STRING_ELT(names, pos[k]));
+    setAttrib(mat, install("wells"), wells);
+
+    // Each file is counted its share (by rows) of the one output matrix,
+    // which is one allocation (of the first file).
+    lxb_stats alloc;
+    memset(&alloc, 0, sizeof(alloc));
+    stats_stop(&alloc, PHASE_ALLOC, t);
+    for (int i = 0, first = 1; i < n && nrow > 0; ++i) {
+        lxb_file *f = &files[i];
+        if (!f->data)
+            continue;
+        f->stats.time[PHASE_ALLOC] = alloc.time[PHASE_ALLOC]
+            * f->plan.nrow / nrow;
+        stats_alloc(&f->stats, PHASE_ALLOC, first, (int64_t)f->plan.nrow
+                * (ncol + 1) * output_size(ref));
+        first = 0;
+    }
+
+    bool real = ref->real;
+    void *dest = real ? (void *)REAL(mat) : (void *)INTEGER(mat);
+    decode_plate(files, n, slot, first, nrow, real, dest, &opts);
+
+    stats_record(files, n);
+    UNPROTECT(5);
+
+    return mat;
+}
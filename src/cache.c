@@ -0,0 +1,290 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "lxb.h"
+
+// On-disk cache of decoded files.
+//
+// Each cache entry holds the output matrix of one file read with one set of
+// options, column-major exactly as R stores it, so a hit only needs to map the
+// entry and hand the mapping to R as the output (no parsing, transposing or
+// copying, see map_vector()).  Compact output is still narrowed from the entry
+// into its own matrix.  Misses are decoded as usual and then written to the
+// cache by the same thread, before the call returns.  Entries are
+// named by a hash of the file path, size, mtime and the options, and are only
+// used if the header and TEXT segment of the file still hash to the value
+// stored in the entry.  (The DATA segment is not hashed since doing so costs
+// as much as reading the file.)
+//
+// Layout of an entry, all integers in native byte order:
+//
+//   cache_header
+//   ncol NUL terminated column names, then the NUL terminated $WELLID (empty
+//   if none), padded to a multiple of 8 bytes
+//   int32 (or double if 'real' is set) data[ncol][nrow]
+
+#define CACHE_MAGIC   "LXBCACHE"
+#define CACHE_VERSION 3
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t ncol;
+    uint32_t real;
+    uint32_t unused;
+    int64_t  nrow;
+    int64_t  size, mtime;       // of the LXB file
+    uint64_t key;               // see cache_key()
+    uint64_t head_hash;         // of header and TEXT segment
+    int64_t  data_offset;       // of 'data' from start of entry
+} cache_header;
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+static uint64_t fnv1a(uint64_t h, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ p[i]) * FNV_PRIME;
+    return h;
+}
+
+static uint64_t fnv1a_str(uint64_t h, const char *s)
+{
+    // Include the terminator so that ("ab", "c") and ("a", "bc") differ.
+    return fnv1a(h, s, strlen(s) + 1);
+}
+
+// Hash of everything that decides what the output for 'filename' is.
+static uint64_t cache_key(const char *filename, int64_t size, int64_t mtime,
+        const lxb_opts *opts)
+{
+    uint32_t version = CACHE_VERSION;
+    uint64_t h = fnv1a(FNV_OFFSET, &version, sizeof(version));
+    h = fnv1a_str(h, filename);
+    h = fnv1a(h, &size, sizeof(size));
+    h = fnv1a(h, &mtime, sizeof(mtime));
+
+    h = fnv1a(h, &opts->ncolumns, sizeof(opts->ncolumns));
+    for (int k = 0; k < opts->ncolumns; ++k)
+        h = fnv1a_str(h, opts->columns[k]);
+    h = fnv1a(h, &opts->filter, sizeof(opts->filter));
+    h = fnv1a(h, &opts->ngates, sizeof(opts->ngates));
+    for (int k = 0; k < opts->ngates; ++k) {
+        h = fnv1a_str(h, opts->gate_columns[k]);
+        h = fnv1a(h, &opts->gate_lo[k], sizeof(double));
+        h = fnv1a(h, &opts->gate_hi[k], sizeof(double));
+    }
+
+    return h;
+}
+
+bool file_stat(const char *filename, int64_t *size, int64_t *mtime)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return false;
+
+    *size  = (int64_t)st.st_size;
+    *mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+static void entry_path(char *buf, size_t len, const char *dir, uint64_t key)
+{
+    snprintf(buf, len, "%s/%016llx.lxbc", dir, (unsigned long long)key);
+}
+
+// Hash of the header and TEXT segment of 'buf', or 0 if there is none.
+static uint64_t head_hash(const char *buf, long size)
+{
+    fcs_header hdr;
+    lxb_log log = { 0 };
+    if (!parse_header(buf, size, &hdr, "", &log))
+        return 0;
+
+    long len = hdr.end_text + 1 < size ? (long)hdr.end_text + 1 : size;
+    return fnv1a(FNV_OFFSET, buf, len);
+}
+
+// Same as head_hash() but only reads the start of 'filename'.
+static uint64_t file_head_hash(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return 0;
+
+    uint64_t h = 0;
+    char head[58];
+    fcs_header hdr;
+    lxb_log log = { 0 };
+    long n = (long)fread(head, 1, sizeof(head), fp);
+    if (parse_header(head, n, &hdr, "", &log) && hdr.end_text > 0
+            && hdr.end_text < (1 << 26)) {
+        long len = (long)hdr.end_text + 1;
+        char *buf = (char *)malloc(len);
+        if (buf && fseek(fp, 0, SEEK_SET) == 0)
+            h = head_hash(buf, (long)fread(buf, 1, len, fp));
+        free(buf);
+    }
+    fclose(fp);
+
+    return h;
+}
+
+bool cache_load(lxb_file *f, const lxb_opts *opts)
+{
+    lxb_cache *c = &f->cache;
+    if (!opts->cache_dir || !file_stat(f->filename, &c->size, &c->mtime))
+        return false;
+    c->key = cache_key(f->filename, c->size, c->mtime, opts);
+
+    char path[4096];
+    entry_path(path, sizeof(path), opts->cache_dir, c->key);
+    c->buf = mmap_file(path, &c->buf_size);
+    if (!c->buf)
+        return false;
+
+    // Anything unexpected (stale, truncated or from another version) is a
+    // miss, after which the entry is overwritten.
+    cache_header hdr;
+    bool ok = c->buf_size >= (long)sizeof(hdr);
+    if (ok) {
+        memcpy(&hdr, c->buf, sizeof(hdr));
+        uint64_t values = (uint64_t)hdr.ncol * (uint64_t)hdr.nrow;
+        uint64_t width = hdr.real ? sizeof(double) : sizeof(int);
+        ok = memcmp(hdr.magic, CACHE_MAGIC, 8) == 0
+            && hdr.version == CACHE_VERSION
+            && hdr.key == c->key && hdr.size == c->size
+            && hdr.mtime == c->mtime
+            && hdr.nrow >= 0 && hdr.nrow <= INT_MAX
+            && hdr.data_offset >= (int64_t)sizeof(hdr)
+            && hdr.data_offset <= c->buf_size
+            && values == (uint64_t)(c->buf_size - hdr.data_offset) / width
+            && values * width == (uint64_t)(c->buf_size - hdr.data_offset);
+    }
+
+    // Every name takes at least one byte of the names block.
+    ok = ok && hdr.ncol < hdr.data_offset - sizeof(hdr);
+    if (ok) {
+        c->names = (const char **)arena_alloc(f->arena,
+                (hdr.ncol + 1) * sizeof(char *));
+        ok = c->names != NULL;
+    }
+
+    // Column names and well must all be terminated inside the names block.
+    const char *name = c->buf + sizeof(hdr);
+    for (uint32_t k = 0; ok && k <= hdr.ncol; ++k) {
+        const char *end = (const char *)memchr(name, 0,
+                c->buf + hdr.data_offset - name);
+        ok = end != NULL;
+        if (k < hdr.ncol)
+            c->names[k] = name;
+        else
+            c->well = name;
+        name = end + 1;
+    }
+
+    if (ok)
+        ok = file_head_hash(f->filename) == hdr.head_hash;
+
+    if (!ok) {
+        cache_free(f);
+        return false;
+    }
+
+    c->nrow = (int)hdr.nrow;
+    c->ncol = (int)hdr.ncol;
+    c->real = hdr.real != 0;
+    c->data = c->buf + hdr.data_offset;
+    return true;
+}
+
+// Write the 'n' compact values in 'data' as ints, see compact.c.
+static bool write_wide(FILE *fp, const void *data, size_t n, int width)
+{
+    int buf[4096];
+    for (size_t i = 0; i < n; i += 4096) {
+        size_t m = n - i < 4096 ? n - i : 4096;
+        widen_ints(buf, (const char *)data + i * width, m, width);
+        if (fwrite(buf, sizeof(int), m, fp) != m)
+            return false;
+    }
+    return true;
+}
+
+void cache_store(const lxb_file *f, const lxb_opts *opts, const void *data)
+{
+    const lxb_cache *c = &f->cache;
+    const decode_plan *plan = &f->plan;
+    if (!opts->cache_dir || !f->data || c->key == 0)
+        return;
+
+    cache_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CACHE_MAGIC, 8);
+    hdr.version   = CACHE_VERSION;
+    hdr.ncol      = plan->ncol;
+    hdr.real      = plan->real;
+    hdr.nrow      = plan->nrow;
+    hdr.size      = c->size;
+    hdr.mtime     = c->mtime;
+    hdr.key       = c->key;
+    hdr.head_hash = head_hash(f->buf, f->size);
+
+    const char *well = file_well_id(f);
+    if (!well)
+        well = "";
+
+    int64_t names_len = strlen(well) + 1;
+    for (int k = 0; k < plan->ncol; ++k)
+        names_len += strlen(plan->par[plan->col[k]].name) + 1;
+    int64_t pad = (8 - (sizeof(hdr) + names_len) % 8) % 8;
+    hdr.data_offset = sizeof(hdr) + names_len + pad;
+
+    // Write to a temporary file first so that concurrent readers never see a
+    // partial entry.
+    char path[4096], tmp[4096 + 64];
+    entry_path(path, sizeof(path), opts->cache_dir, c->key);
+    temp_path(tmp, sizeof(tmp), path);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp)
+        return;
+
+    static const char zeros[8] = { 0 };
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (int k = 0; ok && k < plan->ncol; ++k) {
+        const char *name = plan->par[plan->col[k]].name;
+        ok = fwrite(name, 1, strlen(name) + 1, fp) == strlen(name) + 1;
+    }
+    ok = ok && fwrite(well, 1, strlen(well) + 1, fp) == strlen(well) + 1;
+    ok = ok && fwrite(zeros, 1, pad, fp) == (size_t)pad;
+    size_t n = (size_t)plan->ncol * plan->nrow;
+    if (f->compact)
+        ok = ok && write_wide(fp, data, n, f->compact);
+    else
+        ok = ok && fwrite(data, output_size(plan), n, fp) == n;
+    ok = fclose(fp) == 0 && ok;
+
+#ifdef _WIN32
+    // rename() does not replace existing files on Windows.
+    if (ok)
+        remove(path);
+#endif
+    if (!(ok && rename(tmp, path) == 0))
+        remove(tmp);
+}
+
+void cache_free(lxb_file *f)
+{
+    if (f->cache.buf)
+        munmap_file(f->cache.buf, f->cache.buf_size);
+    arena_free(f->arena, f->cache.names);
+    f->cache.buf   = NULL;
+    f->cache.names = NULL;
+    f->cache.well  = NULL;
+    f->cache.data  = NULL;
+}
@@ -0,0 +1,508 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Rversion.h>
+#include "lxb.h"
+
+// Columnar files of decoded plates, see writeLxbColumns().
+//
+// A columns file holds what readLxb(combine=TRUE) returns for a plate: one
+// matrix, column-major exactly as R stores it, whose first column is the well
+// of each event, together with the well names and the TEXT keywords of each
+// file.  Reading it back maps the file and hands the mapped matrix to R as is
+// (ALTREP, R 3.5.0 or later), so any number of processes can share one copy
+// of a plate in the page cache without parsing or decoding anything.
+//
+// Layout of a file, all integers in the byte order given by 'byte_order':
+//
+//   cols_header
+//   ncol NUL terminated column names, then nfile NUL terminated well names,
+//   then for each well its TEXT keywords as NUL terminated key and value
+//   pairs ending with an empty key (no keywords if the well was not read),
+//   padded to a multiple of 64 bytes
+//   int32 (or double if 'real' is set) data[ncol][nrow]
+//
+// Files are written in native byte order, readers only accept their own.
+
+#define COLS_MAGIC      "LXBCOLS"
+#define COLS_VERSION    1
+#define COLS_BYTE_ORDER 0x01020304u
+#define COLS_ALIGN      64
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;        // COLS_BYTE_ORDER as written
+    uint32_t ncol, nfile;
+    uint32_t real;
+    uint32_t unused;
+    int64_t  nrow;
+    int64_t  data_offset;       // of 'data' from start of file
+} cols_header;
+
+static bool write_str(FILE *fp, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    return fwrite(s, 1, n, fp) == n;
+}
+
+struct write_keyword_s {
+    FILE *fp;
+    bool  ok;
+};
+
+static void write_keyword_f(const char *key, const char *value,
+                            struct write_keyword_s *state)
+{
+    // An empty key would end the list.
+    if (*key)
+        state->ok = state->ok && write_str(state->fp, key)
+            && write_str(state->fp, value);
+}
+
+// Write the names and keywords of the plate laid out by layout_plate(), up to
+// the start of its data.  Sets 'hdr->data_offset'.
+static bool write_names(FILE *fp, cols_header *hdr, const decode_plan *ref,
+        const lxb_file *files, const int *pos, SEXP names)
+{
+    static const char zeros[COLS_ALIGN] = { 0 };
+    bool ok = fwrite(hdr, sizeof(*hdr), 1, fp) == 1 && write_str(fp, "well");
+    for (int k = 0; ok && k < ref->ncol; ++k)
+        ok = write_str(fp, ref->par[ref->col[k]].name);
+    for (uint32_t k = 0; ok && k < hdr->nfile; ++k)
+        ok = write_str(fp, CHAR(STRING_ELT(names, pos[k])));
+
+    struct write_keyword_s state = { fp, ok };
+    for (uint32_t k = 0; state.ok && k < hdr->nfile; ++k) {
+        const lxb_file *f = &files[pos[k]];
+        if (f->data)
+            map_fold(f->txt, (fold_func_t)write_keyword_f, (void *)&state);
+        state.ok = state.ok && write_str(fp, "");
+    }
+
+    long end = state.ok ? ftell(fp) : -1;
+    if (end < 0)
+        return false;
+    long pad = (COLS_ALIGN - end % COLS_ALIGN) % COLS_ALIGN;
+    hdr->data_offset = end + pad;
+    return fwrite(zeros, 1, pad, fp) == (size_t)pad;
+}
+
+// Read many LXB files into one matrix, as read_lxb_plate() (on at most
+// 'inThreads' threads if it is not NULL), and write it to
+// the columns file 'inPath'.  The file is written to a temporary file first
+// so that readers never see a partial one.
+//
+// Returns the number of events written, or NULL if nothing could be.
+SEXP write_lxb_columns(SEXP inFilenames, SEXP inPath, SEXP inColumns,
+        SEXP inFilter, SEXP inGates, SEXP inThreads)
+{
+    int n = LENGTH(inFilenames);
+    const char *path = CHAR(STRING_ELT(inPath, 0));
+    lxb_opts opts;
+    get_opts(&opts, inColumns, inFilter, inGates);
+    opts.threads = threads_arg(inThreads);
+
+    lxb_file *files = (lxb_file *)R_alloc(n, sizeof(lxb_file));
+    R_xlen_t *first = (R_xlen_t *)R_alloc(n, sizeof(R_xlen_t));
+    memset(files, 0, n * sizeof(lxb_file));
+    for (int i = 0; i < n; ++i)
+        files[i].filename = CHAR(STRING_ELT(inFilenames, i));
+
+    reset_arenas();
+    load_files(files, n, &opts);
+
+    // File pos[k] is the k:th well, and slot[pos[k]] = k.
+    int *pos = (int *)R_alloc(n + 1, sizeof(int));
+    int *slot = (int *)R_alloc(n + 1, sizeof(int));
+    const char **filenames = (const char **)R_alloc(n + 1, sizeof(char *));
+    const char **ids = (const char **)R_alloc(n + 1, sizeof(char *));
+    for (int i = 0; i < n; ++i) {
+        filenames[i] = files[i].filename;
+        ids[i] = file_well_id(&files[i]);
+    }
+    SEXP names;
+    PROTECT(names = well_names(filenames, ids, n, pos));
+    for (int k = 0; k < n; ++k)
+        slot[pos[k]] = k;
+
+    R_xlen_t nrow;
+    const decode_plan *ref = layout_plate(files, n, pos, first, &nrow);
+    bool fits = ref && nrow <= INT_MAX;
+    size_t values = fits ? (size_t)nrow * (ref->ncol + 1) : 0;
+    size_t size = fits ? output_size(ref) : 0;
+    void *dest = fits ? malloc(values * size + 1) : NULL;
+
+    char tmp[4096 + 64];
+    temp_path(tmp, sizeof(tmp), path);
+    FILE *fp = dest ? fopen(tmp, "wb") : NULL;
+
+    cols_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, COLS_MAGIC, 8);
+    hdr.version    = COLS_VERSION;
+    hdr.byte_order = COLS_BYTE_ORDER;
+    hdr.ncol       = fits ? ref->ncol + 1 : 0;
+    hdr.nfile      = n;
+    hdr.real       = fits && ref->real;
+    hdr.nrow       = nrow;
+
+    // The names point into the files, so write them before decoding.
+    bool ok = fp && write_names(fp, &hdr, ref, files, pos, names);
+    if (ok) {
+        decode_plate(files, n, slot, first, nrow, hdr.real, dest, &opts);
+    } else {
+        for (int i = 0; i < n; ++i)
+            free_file(&files[i]);
+    }
+    stats_record(files, n);
+
+    ok = ok && fwrite(dest, size, values, fp) == values;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0
+        && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    if (fp)
+        ok = fclose(fp) == 0 && ok;
+    free(dest);
+
+#ifdef _WIN32
+    // rename() does not replace existing files on Windows.
+    if (ok)
+        remove(path);
+#endif
+    ok = ok && rename(tmp, path) == 0;
+    if (fp && !ok)
+        remove(tmp);
+    UNPROTECT(1);
+
+    if (ref && !fits)
+        warning("Too many events to fit in one matrix\n");
+    else if (ref && !dest)
+        warning("Out of memory decoding '%s'\n", path);
+    else if (ref && !ok)
+        warning("Could not write '%s'\n", path);
+    return ok ? ScalarReal((double)nrow) : R_NilValue;
+}
+
+// A columns file mapped (or read) into memory.
+typedef struct {
+    const char *buf;
+    long        size;
+    bool        mapped;
+    const void *data;       // the matrix, inside 'buf'
+    R_xlen_t    n;          // values in 'data'
+    bool        real;
+} cols_file;
+
+static void free_cols(cols_file *c)
+{
+    if (c->mapped)
+        munmap_file(c->buf, c->size);
+    else
+        free((char *)c->buf);
+    c->buf = NULL;
+}
+
+// The NUL terminated string at '*p' (before 'end'), moving '*p' past it, or
+// NULL if it is not terminated.
+static const char *next_str(const char **p, const char *end)
+{
+    const char *s = *p;
+    const char *nul = s < end ? (const char *)memchr(s, 0, end - s) : NULL;
+    *p = nul ? nul + 1 : end;
+    return nul ? s : NULL;
+}
+
+// Check 'c' and return its header, or false if it is not a columns file of
+// this version and byte order.
+static bool check_cols(const cols_file *c, cols_header *hdr)
+{
+    if (c->size < (long)sizeof(*hdr))
+        return false;
+    memcpy(hdr, c->buf, sizeof(*hdr));
+    uint64_t values = (uint64_t)hdr->ncol * (uint64_t)hdr->nrow;
+    uint64_t width = hdr->real ? sizeof(double) : sizeof(int);
+    return memcmp(hdr->magic, COLS_MAGIC, 8) == 0
+        && hdr->version == COLS_VERSION
+        && hdr->byte_order == COLS_BYTE_ORDER
+        && hdr->ncol > 0 && hdr->ncol <= INT_MAX
+        && hdr->nfile <= INT_MAX
+        && hdr->nrow >= 0 && hdr->nrow <= INT_MAX
+        && hdr->data_offset >= (int64_t)sizeof(*hdr)
+        && hdr->data_offset <= c->size
+        && values == (uint64_t)(c->size - hdr->data_offset) / width
+        && values * width == (uint64_t)(c->size - hdr->data_offset);
+}
+
+// Read the names and keywords of 'c', see write_names().  Returns false if
+// any of them runs past the data.
+static bool read_names(const cols_file *c, const cols_header *hdr,
+        SEXP colnames, SEXP wells, SEXP text)
+{
+    const char *p = c->buf + sizeof(*hdr), *end = c->buf + hdr->data_offset;
+    for (uint32_t k = 0; k < hdr->ncol; ++k) {
+        const char *s = next_str(&p, end);
+        if (!s)
+            return false;
+        SET_STRING_ELT(colnames, k, mkChar(s));
+    }
+    for (uint32_t k = 0; k < hdr->nfile; ++k) {
+        const char *s = next_str(&p, end);
+        if (!s)
+            return false;
+        SET_STRING_ELT(wells, k, mkChar(s));
+    }
+
+    for (uint32_t k = 0; k < hdr->nfile; ++k) {
+        // Count the keywords first, then go over them again.
+        const char *start = p, *key;
+        int len = 0;
+        while ((key = next_str(&p, end)) && *key) {
+            if (!next_str(&p, end))
+                return false;
+            ++len;
+        }
+        if (!key)
+            return false;
+
+        SEXP vals, keys;
+        PROTECT(vals = allocVector(STRSXP, len));
+        PROTECT(keys = allocVector(STRSXP, len));
+        p = start;
+        for (int i = 0; i < len; ++i) {
+            // Remove initial dollar sign, as map_to_Rlist() does.
+            const char *key = next_str(&p, end);
+            SET_STRING_ELT(keys, i, mkChar(key + (key[0] == '$')));
+            SET_STRING_ELT(vals, i, mkChar(next_str(&p, end)));
+        }
+        next_str(&p, end);
+        namesgets(vals, keys);
+        SET_VECTOR_ELT(text, k, vals);
+        UNPROTECT(2);
+    }
+
+    return true;
+}
+
+#if R_VERSION >= R_Version(3, 5, 0)
+
+#include <R_ext/Altrep.h>
+
+// One class per output type.  data1 is an external pointer to the cols_file,
+// data2 a copy of the matrix once R has asked to modify it.
+static R_altrep_class_t mapped_int_class, mapped_real_class;
+
+static void cols_finalizer(SEXP ptr)
+{
+    cols_file *c = (cols_file *)R_ExternalPtrAddr(ptr);
+    if (c) {
+        free_cols(c);
+        free(c);
+        R_ClearExternalPtr(ptr);
+    }
+}
+
+static cols_file *cols_of(SEXP x)
+{
+    return (cols_file *)R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+static void *values_of(SEXP x)
+{
+    return TYPEOF(x) == REALSXP ? (void *)REAL(x) : (void *)INTEGER(x);
+}
+
+static R_xlen_t mapped_length(SEXP x)
+{
+    SEXP copy = R_altrep_data2(x);
+    return copy != R_NilValue ? XLENGTH(copy) : cols_of(x)->n;
+}
+
+static const void *mapped_values(SEXP x)
+{
+    SEXP copy = R_altrep_data2(x);
+    return copy != R_NilValue ? values_of(copy) : cols_of(x)->data;
+}
+
+static void *mapped_dataptr(SEXP x, Rboolean writeable)
+{
+    // The mapping is read-only, so it is copied (and released) the first
+    // time R asks to write to it.
+    SEXP copy = R_altrep_data2(x);
+    if (copy == R_NilValue && writeable) {
+        cols_file *c = cols_of(x);
+        size_t size = c->real ? sizeof(double) : sizeof(int);
+        PROTECT(copy = allocVector(TYPEOF(x), c->n));
+        memcpy(values_of(copy), c->data, c->n * size);
+        R_set_altrep_data2(x, copy);
+        cols_finalizer(R_altrep_data1(x));
+        UNPROTECT(1);
+    }
+    return (void *)mapped_values(x);
+}
+
+static const void *mapped_dataptr_or_null(SEXP x)
+{
+    return mapped_values(x);
+}
+
+static int mapped_int_elt(SEXP x, R_xlen_t i)
+{
+    return ((const int *)mapped_values(x))[i];
+}
+
+static double mapped_real_elt(SEXP x, R_xlen_t i)
+{
+    return ((const double *)mapped_values(x))[i];
+}
+
+static R_xlen_t mapped_int_region(SEXP x, R_xlen_t i, R_xlen_t n, int *buf)
+{
+    R_xlen_t len = mapped_length(x);
+    if (n > len - i)
+        n = len - i;
+    memcpy(buf, (const int *)mapped_values(x) + i, n * sizeof(int));
+    return n;
+}
+
+static R_xlen_t mapped_real_region(SEXP x, R_xlen_t i, R_xlen_t n,
+        double *buf)
+{
+    R_xlen_t len = mapped_length(x);
+    if (n > len - i)
+        n = len - i;
+    memcpy(buf, (const double *)mapped_values(x) + i, n * sizeof(double));
+    return n;
+}
+
+static Rboolean mapped_inspect(SEXP x, int pre, int deep, int pvec,
+        void (*inspect_subtree)(SEXP, int, int, int))
+{
+    Rprintf(" lxb mapped columns%s\n",
+            R_altrep_data2(x) != R_NilValue ? " (copied)" : "");
+    return TRUE;
+}
+
+static void set_methods(R_altrep_class_t cls)
+{
+    R_set_altrep_Length_method(cls, mapped_length);
+    R_set_altrep_Inspect_method(cls, mapped_inspect);
+    R_set_altvec_Dataptr_method(cls, mapped_dataptr);
+    R_set_altvec_Dataptr_or_null_method(cls, mapped_dataptr_or_null);
+}
+
+void init_columns(DllInfo *dll)
+{
+    mapped_int_class = R_make_altinteger_class("mapped_int", "lxb", dll);
+    mapped_real_class = R_make_altreal_class("mapped_real", "lxb", dll);
+    set_methods(mapped_int_class);
+    set_methods(mapped_real_class);
+    R_set_altinteger_Elt_method(mapped_int_class, mapped_int_elt);
+    R_set_altinteger_Get_region_method(mapped_int_class, mapped_int_region);
+    R_set_altreal_Elt_method(mapped_real_class, mapped_real_elt);
+    R_set_altreal_Get_region_method(mapped_real_class, mapped_real_region);
+}
+
+// Vector of the matrix of 'c', which it takes over, or NULL if out of memory.
+static SEXP map_values(cols_file *c)
+{
+    cols_file *keep = (cols_file *)malloc(sizeof(cols_file));
+    if (!keep)
+        return R_NilValue;
+    *keep = *c;
+    c->buf = NULL;
+    c->mapped = false;
+
+    SEXP ptr, x;
+    PROTECT(ptr = R_MakeExternalPtr(keep, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, cols_finalizer, TRUE);
+    x = R_new_altrep(keep->real ? mapped_real_class : mapped_int_class, ptr,
+            R_NilValue);
+    UNPROTECT(1);
+    return x;
+}
+
+#else
+
+void init_columns(DllInfo *dll)
+{
+}
+
+static SEXP map_values(cols_file *c)
+{
+    return R_NilValue;
+}
+
+#endif
+
+SEXP map_vector(const char *buf, long size, const void *data, R_xlen_t n,
+        bool real)
+{
+    cols_file c = { buf, size, true, data, n, real };
+    return map_values(&c);
+}
+
+// Read the columns file 'inPath' written by write_lxb_columns().
+//
+// Returns the matrix, with the "wells" and "text" (a list with the keywords
+// of each well) attributes, or NULL if the file could not be read.
+SEXP read_lxb_columns(SEXP inPath)
+{
+    const char *path = CHAR(STRING_ELT(inPath, 0));
+    cols_file c;
+    memset(&c, 0, sizeof(c));
+    c.buf = mmap_file(path, &c.size);
+    c.mapped = c.buf != NULL;
+    if (!c.buf)
+        c.buf = read_file(path, &c.size);
+    if (!c.buf) {
+        warning("Could not read file: %s\n", path);
+        return R_NilValue;
+    }
+
+    cols_header hdr;
+    if (!check_cols(&c, &hdr)) {
+        free_cols(&c);
+        warning("Bad LXB columns file '%s'\n", path);
+        return R_NilValue;
+    }
+    c.data = c.buf + hdr.data_offset;
+    c.n    = (R_xlen_t)hdr.ncol * hdr.nrow;
+    c.real = hdr.real != 0;
+
+    SEXP colnames, wells, text;
+    PROTECT(colnames = allocVector(STRSXP, hdr.ncol));
+    PROTECT(wells = allocVector(STRSXP, hdr.nfile));
+    PROTECT(text = allocVector(VECSXP, hdr.nfile));
+    if (!read_names(&c, &hdr, colnames, wells, text)) {
+        free_cols(&c);
+        UNPROTECT(3);
+        warning("Bad LXB columns file '%s'\n", path);
+        return R_NilValue;
+    }
+
+    // Copy the matrix if it cannot be mapped.
+    SEXP mat = map_values(&c);
+    if (isNull(mat)) {
+        mat = allocVector(c.real ? REALSXP : INTSXP, c.n);
+        memcpy(c.real ? (void *)REAL(mat) : (void *)INTEGER(mat), c.data,
+                c.n * (c.real ? sizeof(double) : sizeof(int)));
+        free_cols(&c);
+    }
+    PROTECT(mat);
+
+    SEXP dim, dimnames;
+    PROTECT(dim = allocVector(INTSXP, 2));
+    INTEGER(dim)[0] = (int)hdr.nrow;
+    INTEGER(dim)[1] = (int)hdr.ncol;
+    setAttrib(mat, R_DimSymbol, dim);
+    PROTECT(dimnames = allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, R_NilValue);
+    SET_VECTOR_ELT(dimnames, 1, colnames);
+    dimnamesgets(mat, dimnames);
+    setAttrib(mat, install("wells"), wells);
+    setAttrib(mat, install("text"), text);
+
+    UNPROTECT(6);
+    return mat;
+}
@@ -0,0 +1,277 @@
+#include <stdint.h>
+#include <string.h>
+#include <Rversion.h>
+#include "lxb.h"
+
+// Compact integer output, see readLxb(compact=TRUE).
+//
+// Most parameters of an LXB file are stored as 32 bit integers, but their
+// $PnR ranges are far narrower (RID is at most 500, the reporter channels are
+// 16 bit).  A compact matrix stores each value in the fewest bytes (1 or 2)
+// that hold the widest of its columns, as an ALTREP integer vector, so to R it
+// is an ordinary integer matrix that takes a half or a quarter of the memory.
+// Values are widened one at a time (or a region at a time) as R reads them,
+// and the whole vector is only expanded into 32 bit integers if R asks for a
+// pointer to its data, e.g. to modify it.
+//
+// The storage is a raw vector ('data1' of the ALTREP object), and once
+// expanded the integer vector ('data2') replaces it.  Serialized (e.g. by
+// saveRDS()) compact vectors stay compact.
+//
+// ALTREP needs R 3.5.0 or later.  On older versions nothing is compact and
+// the readers fall back on ordinary integer matrices.
+
+// Max number of values decoded at a time by decode_compact().
+#define COMPACT_CHUNK 8192
+
+void narrow_ints(void *dest, const int *src, size_t n, int width)
+{
+    if (width == 1) {
+        uint8_t *d = (uint8_t *)dest;
+        for (size_t i = 0; i < n; ++i)
+            d[i] = (uint8_t)src[i];
+    } else {
+        uint16_t *d = (uint16_t *)dest;
+        for (size_t i = 0; i < n; ++i)
+            d[i] = (uint16_t)src[i];
+    }
+}
+
+void widen_ints(int *dest, const void *src, size_t n, int width)
+{
+    if (width == 1) {
+        const uint8_t *s = (const uint8_t *)src;
+        for (size_t i = 0; i < n; ++i)
+            dest[i] = s[i];
+    } else {
+        const uint16_t *s = (const uint16_t *)src;
+        for (size_t i = 0; i < n; ++i)
+            dest[i] = s[i];
+    }
+}
+
+void decode_compact(lxb_file *f, void *dest)
+{
+    // Decode the events a chunk at a time into 32 bit integers (as if they
+    // were all there is) and narrow each column of the chunk into place.
+    const decode_plan *plan = &f->plan;
+    int width = f->compact;
+    int ncol = plan->ncol;
+    // compact_width() is 0 if 'ncol' is more than COMPACT_CHUNK.
+    int step = ncol > 0 ? COMPACT_CHUNK / ncol : 1;
+    int chunk[COMPACT_CHUNK];
+    for (int start = 0; start < plan->nrow; start += step) {
+        decode_plan part = *plan;
+        const char *src = f->data;
+        part.nrow = plan->nrow - start < step ? plan->nrow - start : step;
+        part.ld = 0;
+        if (plan->rows)
+            part.rows = plan->rows + start;
+        else
+            src += (size_t)start * plan->stride;
+        copy_data(chunk, src, &part);
+
+        for (int k = 0; k < ncol; ++k) {
+            size_t at = (size_t)k * plan->nrow + start;
+            narrow_ints((char *)dest + at * width,
+                    chunk + (size_t)k * part.nrow, part.nrow, width);
+        }
+    }
+}
+
+#if R_VERSION >= R_Version(3, 5, 0)
+
+#include <R_ext/Altrep.h>
+
+// One class per width, data1 holds 'width' bytes per value.
+static R_altrep_class_t compact8_class, compact16_class;
+
+static int class_width(SEXP x)
+{
+    return R_altrep_inherits(x, compact8_class) ? 1 : 2;
+}
+
+static SEXP new_compact(SEXP raw, int width)
+{
+    return R_new_altrep(width == 1 ? compact8_class : compact16_class, raw,
+            R_NilValue);
+}
+
+static R_xlen_t compact_length(SEXP x)
+{
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue)
+        return XLENGTH(full);
+    return XLENGTH(R_altrep_data1(x)) / class_width(x);
+}
+
+static int compact_elt(SEXP x, R_xlen_t i)
+{
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue)
+        return INTEGER(full)[i];
+    const Rbyte *raw = RAW(R_altrep_data1(x));
+    return class_width(x) == 1 ? raw[i] : ((const uint16_t *)raw)[i];
+}
+
+static R_xlen_t compact_get_region(SEXP x, R_xlen_t i, R_xlen_t n, int *buf)
+{
+    R_xlen_t len = compact_length(x);
+    if (n > len - i)
+        n = len - i;
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue) {
+        memcpy(buf, INTEGER(full) + i, n * sizeof(int));
+    } else {
+        int width = class_width(x);
+        widen_ints(buf, RAW(R_altrep_data1(x)) + i * width, n, width);
+    }
+    return n;
+}
+
+static void *compact_dataptr(SEXP x, Rboolean writeable)
+{
+    SEXP full = R_altrep_data2(x);
+    if (full == R_NilValue) {
+        R_xlen_t n = compact_length(x);
+        PROTECT(full = allocVector(INTSXP, n));
+        widen_ints(INTEGER(full), RAW(R_altrep_data1(x)), n, class_width(x));
+        R_set_altrep_data2(x, full);
+        R_set_altrep_data1(x, R_NilValue);
+        UNPROTECT(1);
+    }
+    return INTEGER(full);
+}
+
+static const void *compact_dataptr_or_null(SEXP x)
+{
+    SEXP full = R_altrep_data2(x);
+    return full != R_NilValue ? INTEGER(full) : NULL;
+}
+
+static int compact_no_na(SEXP x)
+{
+    // Narrow values are never NA, but expanded ones may have been modified.
+    return R_altrep_data2(x) == R_NilValue;
+}
+
+static SEXP compact_duplicate(SEXP x, Rboolean deep)
+{
+    // An expanded vector is duplicated as an ordinary one (NULL).
+    if (R_altrep_data2(x) != R_NilValue)
+        return NULL;
+    return new_compact(duplicate(R_altrep_data1(x)), class_width(x));
+}
+
+static SEXP compact_serialized_state(SEXP x)
+{
+    SEXP full = R_altrep_data2(x);
+    return full != R_NilValue ? full : R_altrep_data1(x);
+}
+
+static SEXP unserialize(SEXP state, int width)
+{
+    return TYPEOF(state) == INTSXP ? state : new_compact(state, width);
+}
+
+static SEXP compact8_unserialize(SEXP cls, SEXP state)
+{
+    return unserialize(state, 1);
+}
+
+static SEXP compact16_unserialize(SEXP cls, SEXP state)
+{
+    return unserialize(state, 2);
+}
+
+static Rboolean compact_inspect(SEXP x, int pre, int deep, int pvec,
+        void (*inspect_subtree)(SEXP, int, int, int))
+{
+    Rprintf(" lxb compact %d bit%s\n", 8 * class_width(x),
+            R_altrep_data2(x) != R_NilValue ? " (expanded)" : "");
+    return TRUE;
+}
+
+static void set_methods(R_altrep_class_t cls, R_altrep_Unserialize_method_t
+        unserialize_method)
+{
+    R_set_altrep_Length_method(cls, compact_length);
+    R_set_altrep_Inspect_method(cls, compact_inspect);
+    R_set_altrep_Duplicate_method(cls, compact_duplicate);
+    R_set_altrep_Serialized_state_method(cls, compact_serialized_state);
+    R_set_altrep_Unserialize_method(cls, unserialize_method);
+    R_set_altvec_Dataptr_method(cls, compact_dataptr);
+    R_set_altvec_Dataptr_or_null_method(cls, compact_dataptr_or_null);
+    R_set_altinteger_Elt_method(cls, compact_elt);
+    R_set_altinteger_Get_region_method(cls, compact_get_region);
+    R_set_altinteger_No_NA_method(cls, compact_no_na);
+}
+
+void init_compact(DllInfo *dll)
+{
+    compact8_class = R_make_altinteger_class("compact8", "lxb", dll);
+    compact16_class = R_make_altinteger_class("compact16", "lxb", dll);
+    set_methods(compact8_class, compact8_unserialize);
+    set_methods(compact16_class, compact16_unserialize);
+}
+
+// Bytes per value needed for values of at most 'max', or 0 if more than 2.
+static int width_of(uint64_t max)
+{
+    return max <= UINT8_MAX ? 1 : max <= UINT16_MAX ? 2 : 0;
+}
+
+int compact_width(const decode_plan *plan)
+{
+    // decode_compact() needs room for at least one event per chunk.
+    if (plan->real || plan->ncol > COMPACT_CHUNK)
+        return 0;
+    unsigned max = 0;
+    for (int k = 0; k < plan->ncol; ++k)
+        max |= plan->mask[k];
+    return width_of(max);
+}
+
+int compact_data_width(const int *data, size_t n)
+{
+    // Cached data has no $PnR, so go by the values.
+    unsigned max = 0;
+    for (size_t i = 0; i < n; ++i)
+        max |= (unsigned)data[i];
+    return width_of(max);
+}
+
+SEXP alloc_compact(R_xlen_t n, int width, void **dest)
+{
+    SEXP raw, x;
+    PROTECT(raw = allocVector(RAWSXP, n * width));
+    x = new_compact(raw, width);
+    *dest = RAW(raw);
+    UNPROTECT(1);
+    return x;
+}
+
+#else
+
+void init_compact(DllInfo *dll)
+{
+}
+
+int compact_width(const decode_plan *plan)
+{
+    return 0;
+}
+
+int compact_data_width(const int *data, size_t n)
+{
+    return 0;
+}
+
+SEXP alloc_compact(R_xlen_t n, int width, void **dest)
+{
+    // Never called, compact_width() is always 0.
+    *dest = NULL;
+    return R_NilValue;
+}
+
+#endif
@@ -0,0 +1,560 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "decode.h"
+
+// NOTE: R stores matrices in column-major order but the data in the LXB file
+// is in row-major order so all kernels copy the data transposed.
+//
+// NOTE: Values are loaded in the byte order of the machine.  Files stored in
+// the other byte order ('plan->swap') are decoded by the *_swap kernels, which
+// reverse the bytes of each value after loading it.
+//
+// NOTE: All integer kernels except decode_mixed() assume that every parameter
+// is decoded, in order, so that column i holds parameter i.
+
+static inline uint16_t bswap16(uint16_t v)
+{
+    return (uint16_t)(v << 8 | v >> 8);
+}
+
+static inline uint32_t bswap32(uint32_t v)
+{
+#if defined(__GNUC__)
+    return __builtin_bswap32(v);
+#else
+    return v << 24 | (v & 0xff00) << 8 | (v >> 8 & 0xff00) | v >> 24;
+#endif
+}
+
+static inline uint64_t bswap64(uint64_t v)
+{
+#if defined(__GNUC__)
+    return __builtin_bswap64(v);
+#else
+    return (uint64_t)bswap32((uint32_t)v) << 32 | bswap32((uint32_t)(v >> 32));
+#endif
+}
+
+static inline uint32_t load_u32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint16_t load_u16(const char *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Load 'size' bytes (at most 4) without reading past them.
+static inline uint32_t load_exact(const char *p, int size)
+{
+    uint32_t v = 0;
+    memcpy(&v, p, size < 4 ? size : 4);
+    return v;
+}
+
+// Value of the first 'size' bytes (at most 4) of 'v' as loaded from memory,
+// which may also hold the bytes following them (removed by the mask on little
+// endian machines).  swap_value() is the same for the other byte order.
+static inline uint32_t native_value(uint32_t v, int size)
+{
+    return HOST_BIG_ENDIAN ? v >> (32 - 8*size) : v;
+}
+
+static inline uint32_t swap_value(uint32_t v, int size)
+{
+    v = bswap32(v);
+    return HOST_BIG_ENDIAN ? v : v >> (32 - 8*size);
+}
+
+// Kernels for parameters of the same width.
+#define DECODE_UNIFORM(name, LOAD) \
+static void name(int *dest, const char *src, const decode_plan *plan) \
+{ \
+    int ncol = plan->ncol, nrow = plan->nrow; \
+    size_t ld = output_stride(plan); \
+    for (int j = 0; j < nrow; ++j) { \
+        const char *p = event_ptr(src, plan, j); \
+        for (int i = 0; i < ncol; ++i) \
+            dest[i*ld + j] = LOAD & plan->mask[i]; \
+    } \
+}
+
+// All parameters are 32 bits wide (the usual LXB layout).
+DECODE_UNIFORM(decode_u32, load_u32(p + 4*i))
+DECODE_UNIFORM(decode_u32_swap, bswap32(load_u32(p + 4*i)))
+DECODE_UNIFORM(decode_u16, load_u16(p + 2*i))
+DECODE_UNIFORM(decode_u16_swap, bswap16(load_u16(p + 2*i)))
+DECODE_UNIFORM(decode_u8, (unsigned char)p[i])
+
+// Parameters of different widths, or only some of the parameters.  Every value
+// is loaded from its offset in the event as 32 bits and then masked down to
+// its width, which may read up to 3 bytes into the next value.  That is fine
+// for all but the last event, which is loaded byte by byte so as not to read
+// past the end of the DATA segment (which may be a mapped file).
+#define DECODE_MIXED(name, LOAD, LOAD_EXACT) \
+static void name(int *dest, const char *src, const decode_plan *plan) \
+{ \
+    int ncol = plan->ncol, nrow = plan->nrow; \
+    size_t ld = output_stride(plan); \
+    for (int j = 0; j < nrow - 1; ++j) { \
+        const char *p = event_ptr(src, plan, j); \
+        for (int i = 0; i < ncol; ++i) \
+            dest[i*ld + j] = LOAD & plan->mask[i]; \
+    } \
+\
+    if (nrow == 0) \
+        return; \
+    const char *p = event_ptr(src, plan, nrow - 1); \
+    for (int i = 0; i < ncol; ++i) \
+        dest[i*ld + nrow-1] = LOAD_EXACT & plan->mask[i]; \
+}
+
+DECODE_MIXED(decode_mixed,
+        native_value(load_u32(p + plan->offset[i]), plan->size[i]),
+        native_value(load_exact(p + plan->offset[i], plan->size[i]),
+            plan->size[i]))
+DECODE_MIXED(decode_mixed_swap,
+        swap_value(load_u32(p + plan->offset[i]), plan->size[i]),
+        swap_value(load_exact(p + plan->offset[i], plan->size[i]),
+            plan->size[i]))
+
+// Load 'size' bytes (at most 8) without reading past them.
+static inline uint64_t load_exact64(const char *p, int size)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, size < 8 ? size : 8);
+    return v;
+}
+
+static inline double load_f32(const char *p, bool swap)
+{
+    uint32_t u;
+    float v;
+    memcpy(&u, p, sizeof(u));
+    if (swap)
+        u = bswap32(u);
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+static inline double load_f64(const char *p, bool swap)
+{
+    uint64_t u;
+    double v;
+    memcpy(&u, p, sizeof(u));
+    if (swap)
+        u = bswap64(u);
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+// Integer of 'size' bytes (at most 8) at 'p', see native_value().
+static inline uint64_t load_int64(const char *p, int size, bool swap)
+{
+    uint64_t v = load_exact64(p, size);
+    if (swap)
+        v = bswap64(v);
+    return HOST_BIG_ENDIAN != swap ? v >> (64 - 8*size) : v;
+}
+
+static inline double load_i64(const char *p, const decode_plan *plan, int i,
+        bool swap)
+{
+    return (double)(load_int64(p, plan->size[i], swap) & plan->mask64[i]);
+}
+
+// Kernels with double output, one per $DATATYPE and byte order.  Each is
+// generated from the same loop so that the load is inlined instead of being
+// picked per value.
+#define DECODE_REAL(name, LOAD) \
+static void name(double *dest, const char *src, const decode_plan *plan) \
+{ \
+    int ncol = plan->ncol, nrow = plan->nrow; \
+    size_t ld = output_stride(plan); \
+    for (int j = 0; j < nrow; ++j) { \
+        const char *p = event_ptr(src, plan, j); \
+        for (int i = 0; i < ncol; ++i) \
+            dest[i*ld + j] = LOAD; \
+    } \
+}
+
+// Integers of any width up to 64 bits (if some are wider than 32 bits).
+// NOTE: Values above 2^53 are rounded to the nearest double.
+DECODE_REAL(decode_i64, load_i64(p + plan->offset[i], plan, i, false))
+DECODE_REAL(decode_i64_swap, load_i64(p + plan->offset[i], plan, i, true))
+// IEEE single and double precision in list mode
+DECODE_REAL(decode_f32, load_f32(p + plan->offset[i], false))
+DECODE_REAL(decode_f32_swap, load_f32(p + plan->offset[i], true))
+DECODE_REAL(decode_f64, load_f64(p + plan->offset[i], false))
+DECODE_REAL(decode_f64_swap, load_f64(p + plan->offset[i], true))
+
+// Value of parameter 'par' of the event at 'p', as it is decoded.
+static inline double load_value(const char *p, const decode_plan *plan,
+        const par_desc *par)
+{
+    p += par->offset;
+    switch (plan->datatype) {
+    case 'F':
+        return load_f32(p, plan->swap);
+    case 'D':
+        return load_f64(p, plan->swap);
+    default:
+        if (par->size > 4)
+            return (double)(load_int64(p, par->size, plan->swap) & par->mask);
+        // Same as decode_u32() for values with the top bit set.
+        return (int)(load_int64(p, par->size, plan->swap)
+                & (unsigned)par->mask);
+    }
+}
+
+// Returns 'l' or 'b' for the little and big endian orders of $BYTEORD, or 0
+// for anything else (such as the mixed orders allowed by FCS 2.0).
+char byte_order(const char *byteord)
+{
+    // Little endian is "1,2,...,n" and big endian is "n,...,2,1".
+    int first = 0, last = 0, n = 0, step = 0;
+    for (const char *s = byteord; *s; ) {
+        char *end;
+        long k = strtol(s, &end, 10);
+        if (end == s || k < 1 || k > 8)
+            return 0;
+        if (n == 1)
+            step = (int)k - last;
+        else if (n > 1 && (int)k - last != step)
+            return 0;
+        if (n == 0)
+            first = (int)k;
+        last = (int)k;
+        ++n;
+
+        s = end;
+        while (*s == ' ')
+            ++s;
+        if (*s == ',')
+            ++s;
+    }
+
+    if (n == 1 && first == 1)
+        return 'l';
+    if (first == 1 && last == n && step == 1)
+        return 'l';
+    if (first == n && last == 1 && step == -1)
+        return 'b';
+    return 0;
+}
+
+// Bytes per cache line, the parameter and column arrays start on one each.
+#define CACHE_LINE 64
+
+static size_t round_up(size_t n)
+{
+    return (n + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+// Alloc 'size' bytes (of which 'n' arrays of sizes[k] each start on a cache
+// line) from 'arena' into '*mem' and point each of arrays[k] at its array.
+static bool alloc_arrays(lxb_arena *arena, void **mem, int n,
+        void **arrays[], const size_t sizes[])
+{
+    size_t total = 0;
+    for (int k = 0; k < n; ++k)
+        total += round_up(sizes[k]);
+
+    arena_free(arena, *mem);
+    *mem = arena_alloc(arena, total + CACHE_LINE);
+    if (!*mem)
+        return false;
+
+    char *p = (char *)round_up((size_t)*mem);
+    for (int k = 0; k < n; ++k) {
+        *arrays[k] = p;
+        p += round_up(sizes[k]);
+    }
+    return true;
+}
+
+const char *parameter_key(par_key buf, int n, char type)
+{
+    if (n < 0)
+        return "";
+
+    sprintf(buf, "$P%d%c", n+1, type);
+    return buf;
+}
+
+bool describe_parameters(decode_plan *plan, map_t txt)
+{
+    plan->npar = map_get_int(txt, "$PAR");
+    plan->ntot = map_get_int(txt, "$TOT");
+    plan->datatype = toupper((unsigned char)*map_get(txt, "$DATATYPE"));
+    plan->swap = byte_order(map_get(txt, "$BYTEORD"))
+        == (HOST_BIG_ENDIAN ? 'l' : 'b');
+    plan->stride = 0;
+
+    if (plan->npar < 0)
+        plan->npar = 0;
+
+    void **arrays[] = { (void **)&plan->par };
+    size_t sizes[] = { plan->npar * sizeof(par_desc) };
+    if (!alloc_arrays(plan->arena, &plan->par_mem, 1, arrays, sizes)) {
+        plan->npar = 0;
+        return false;
+    }
+
+    par_key buf;
+    for (int i = 0; i < plan->npar; ++i) {
+        par_desc *par = &plan->par[i];
+        par->name  = map_get(txt, parameter_key(buf, i, 'N'));
+        par->bits  = map_get_int(txt, parameter_key(buf, i, 'B'));
+        par->range = strtod(map_get(txt, parameter_key(buf, i, 'R')), NULL);
+
+        // Values wider than 64 bits are truncated to their lowest 64 bits.
+        par->mask = par->bits < 64 ? ~(~0ull << par->bits) : ~0ull;
+
+        // NOTE: MagPIX LXBs may have negative PnR parameters.  Not sure how to
+        // interpret this so just ignore such entries.  For F and D data the
+        // range is not a bit mask.
+        if (plan->datatype == 'I' && par->range > 0
+                && par->range < 18446744073709551616.0)
+            par->mask &= (uint64_t)par->range - 1;
+
+        par->size     = par->bits >> 3;
+        par->offset   = plan->stride;
+        plan->stride += par->size;
+    }
+
+    return true;
+}
+
+int find_parameter(const decode_plan *plan, const char *name)
+{
+    for (int i = 0; i < plan->npar; ++i) {
+        if (strcmp(name, plan->par[i].name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+bool make_plan(decode_plan *plan, const int *cols, int ncol)
+{
+    plan->nrow = plan->ntot;
+    plan->ld = 0;
+    plan->rows = NULL;
+
+    plan->ncol = cols ? ncol : plan->npar;
+    size_t n = plan->ncol;
+    void **arrays[] = {
+        (void **)&plan->col, (void **)&plan->mask, (void **)&plan->mask64,
+        (void **)&plan->size, (void **)&plan->offset
+    };
+    size_t sizes[] = {
+        n * sizeof(int), n * sizeof(unsigned), n * sizeof(uint64_t),
+        n * sizeof(int), n * sizeof(int)
+    };
+    if (!alloc_arrays(plan->arena, &plan->col_mem, 5, arrays, sizes)) {
+        plan->ncol = 0;
+        return false;
+    }
+
+    plan->real = plan->datatype != 'I';
+    bool identity = plan->ncol == plan->npar;
+    int common_size = -1;
+    for (int k = 0; k < plan->ncol; ++k) {
+        int i = cols ? cols[k] : k;
+        identity &= i == k;
+
+        const par_desc *par = &plan->par[i];
+        plan->col[k]    = i;
+        plan->mask[k]   = (unsigned)par->mask;
+        plan->mask64[k] = par->mask;
+        plan->size[k]   = par->size;
+        plan->offset[k] = par->offset;
+
+        if (k == 0)
+            common_size = par->size;
+        else if (common_size != par->size)
+            common_size = -1;
+
+        plan->real |= par->size > 4;
+    }
+
+    plan->kernel = NULL;
+    plan->real_kernel = NULL;
+    if (plan->real) {
+        switch (plan->datatype) {
+        case 'F':
+            plan->real_kernel = plan->swap ? decode_f32_swap : decode_f32;
+            plan->kernel_name = plan->swap ? "f32-swap" : "f32";
+            break;
+        case 'D':
+            plan->real_kernel = plan->swap ? decode_f64_swap : decode_f64;
+            plan->kernel_name = plan->swap ? "f64-swap" : "f64";
+            break;
+        default:
+            plan->real_kernel = plan->swap ? decode_i64_swap : decode_i64;
+            plan->kernel_name = plan->swap ? "i64-swap" : "i64";
+            break;
+        }
+        return true;
+    }
+
+    // Only decode_mixed() can skip parameters.
+    if (!identity)
+        common_size = -1;
+
+    bool swap = plan->swap;
+    switch (common_size) {
+    case 4:
+        plan->kernel = simd_u32_kernel(plan->ncol, swap, &plan->kernel_name);
+        if (!plan->kernel) {
+            plan->kernel = swap ? decode_u32_swap : decode_u32;
+            plan->kernel_name = swap ? "u32-swap" : "u32";
+        }
+        break;
+    case 2:
+        plan->kernel = swap ? decode_u16_swap : decode_u16;
+        plan->kernel_name = swap ? "u16-swap" : "u16";
+        break;
+    case 1:
+        // Single bytes have no byte order.
+        plan->kernel = decode_u8;
+        plan->kernel_name = "u8";
+        break;
+    default:
+        plan->kernel = swap ? decode_mixed_swap : decode_mixed;
+        plan->kernel_name = swap ? "mixed-swap" : "mixed";
+        break;
+    }
+
+    return true;
+}
+
+bool filter_rows(decode_plan *plan, const char *src, const row_filter *filters,
+        int nfilter)
+{
+    if (nfilter == 0)
+        return true;
+
+    int *rows = (int *)arena_alloc(plan->arena,
+            (plan->ntot > 0 ? plan->ntot : 1) * sizeof(int));
+    if (!rows)
+        return false;
+
+    // NOTE: Filtered parameters are loaded exactly so that the last event is
+    // handled safely.
+    int nrow = 0;
+    for (int j = 0; j < plan->ntot; ++j) {
+        const char *p = src + (size_t)j * plan->stride;
+        bool keep = true;
+        for (int k = 0; keep && k < nfilter; ++k) {
+            const row_filter *f = &filters[k];
+            double v = load_value(p, plan, &plan->par[f->par]);
+            keep = f->nonzero ? v != 0 : (f->lo <= v && v <= f->hi);
+        }
+        rows[nrow] = j;
+        nrow += keep;
+    }
+
+    if (nrow == plan->ntot) {
+        // Nothing filtered out so keep fast path for decoding all events.
+        arena_free(plan->arena, rows);
+    } else {
+        plan->rows = rows;
+        plan->nrow = nrow;
+    }
+
+    return true;
+}
+
+void free_rows(decode_plan *plan)
+{
+    arena_free(plan->arena, plan->rows);
+    plan->rows = NULL;
+}
+
+void free_plan(decode_plan *plan)
+{
+    free_rows(plan);
+    arena_free(plan->arena, plan->par_mem);
+    arena_free(plan->arena, plan->col_mem);
+    plan->par_mem = plan->col_mem = NULL;
+    plan->par = NULL;
+    plan->col = NULL;
+    plan->ncol = plan->npar = 0;
+}
+
+bool keep_plan(decode_plan *dst, const decode_plan *src)
+{
+    *dst = *src;
+    dst->arena = NULL;
+    dst->par = NULL;
+    dst->par_mem = dst->col_mem = NULL;
+    dst->rows = NULL;
+    dst->npar = 0;
+
+    size_t n = src->ncol;
+    void **arrays[] = {
+        (void **)&dst->col, (void **)&dst->mask, (void **)&dst->mask64,
+        (void **)&dst->size, (void **)&dst->offset
+    };
+    size_t sizes[] = {
+        n * sizeof(int), n * sizeof(unsigned), n * sizeof(uint64_t),
+        n * sizeof(int), n * sizeof(int)
+    };
+    if (!alloc_arrays(NULL, &dst->col_mem, 5, arrays, sizes))
+        return false;
+    memcpy(dst->col, src->col, sizes[0]);
+    memcpy(dst->mask, src->mask, sizes[1]);
+    memcpy(dst->mask64, src->mask64, sizes[2]);
+    memcpy(dst->size, src->size, sizes[3]);
+    memcpy(dst->offset, src->offset, sizes[4]);
+
+    if (src->rows) {
+        dst->rows = (int *)malloc((src->nrow + 1) * sizeof(int));
+        if (!dst->rows) {
+            free_plan(dst);
+            return false;
+        }
+        memcpy(dst->rows, src->rows, src->nrow * sizeof(int));
+    }
+
+    return true;
+}
+
+void column_plan(decode_plan *one, const decode_plan *plan, int k)
+{
+    *one = *plan;
+    one->ncol = 1;
+    one->ld = 0;
+    one->col += k;
+    one->mask += k;
+    one->mask64 += k;
+    one->size += k;
+    one->offset += k;
+    one->par_mem = one->col_mem = NULL;
+
+    // The real kernels take any columns, of the integer ones only
+    // decode_mixed() does.
+    if (!plan->real) {
+        one->kernel = plan->swap ? decode_mixed_swap : decode_mixed;
+        one->kernel_name = plan->swap ? "mixed-swap" : "mixed";
+    }
+}
+
+void copy_data(void *dest, const char *src, const decode_plan *plan)
+{
+    if (plan->real)
+        plan->real_kernel((double *)dest, src, plan);
+    else
+        plan->kernel((int *)dest, src, plan);
+}
@@ -0,0 +1,149 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+#include "map_lib.h"
+
+// Byte order of this machine
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG_ENDIAN 1
+#else
+#define HOST_BIG_ENDIAN 0
+#endif
+
+// Max chars needed to print a parameter number (any positive int)
+#define MAX_PAR_CHARS 10
+
+// Key is of format "$PXY", where len(X) <= MAX_PAR_CHARS, and Y == type,
+// also include room for null terminator.
+typedef char par_key[MAX_PAR_CHARS+4];
+
+const char *parameter_key(par_key buf, int n, char type);
+
+// One parameter of a file as given by its $PnN, $PnB and $PnR keywords.
+typedef struct {
+    const char *name;           // points into the TEXT segment map
+    int bits;
+    double range;
+    uint64_t mask;              // applied to each (integer) value
+    int size;                   // bytes per value
+    int offset;                 // byte offset of value inside event
+} par_desc;
+
+struct decode_plan_s;
+typedef void (*decode_kernel_t)(int *dest, const char *src,
+                                const struct decode_plan_s *plan);
+typedef void (*decode_real_kernel_t)(double *dest, const char *src,
+                                     const struct decode_plan_s *plan);
+
+// How to decode the DATA segment of one file.  The parameters are looked up in
+// the text segment once by describe_parameters(), after which neither
+// make_plan() nor copy_data() look at the text segment at all.
+//
+// Only the 'ncol' parameters listed in 'col' are decoded, one output column
+// each, and the arrays below are indexed by output column.  Likewise only the
+// 'nrow' events listed in 'rows' are decoded (all events if 'rows' is NULL).
+// Output column i starts at dest + i*ld, where ld defaults to 'nrow' (0).
+//
+// The parameter and column arrays are sized to the file and each starts on a
+// cache line, see free_plan().  They (and 'rows') come from 'arena', which
+// must be set before describe_parameters() if it is not NULL.
+//
+// The output is int (INTSXP) if every decoded parameter is an integer of at
+// most 32 bits, which is what nearly all LXB files hold.  Otherwise it is
+// double (REALSXP) and 'real_kernel' is used instead of 'kernel'.
+typedef struct decode_plan_s {
+    int npar, ntot;             // parameters and events in file
+    char datatype;              // 'I', 'F' or 'D' ($DATATYPE)
+    bool swap;                  // not in the byte order of this machine
+    int stride;                 // bytes per event
+    int ncol, nrow;
+    int ld;                     // output column stride, or 0 for 'nrow'
+    int *col;                   // parameter decoded into each column
+    unsigned *mask;             // applied to each value
+    uint64_t *mask64;           // same but for values wider than 32 bits
+    int *size;                  // bytes per value
+    int *offset;                // byte offset of value inside event
+    int *rows;                  // alloc'ed by filter_rows(), see free_rows()
+    bool real;                  // output is double
+    decode_kernel_t kernel;     // picked from the parameter widths
+    decode_real_kernel_t real_kernel;
+    const char *kernel_name;
+
+    par_desc *par;              // indexed by parameter
+    void *par_mem, *col_mem;    // alloc'ed blocks holding the arrays above
+    lxb_arena *arena;           // or NULL for malloc()
+} decode_plan;
+
+// Keep events where parameter 'par' is non-zero, or in [lo, hi] if 'nonzero'
+// is false.
+typedef struct {
+    int    par;
+    bool   nonzero;
+    double lo, hi;
+} row_filter;
+
+// Start of the event decoded into output row 'j'.
+static inline const char *event_ptr(const char *src, const decode_plan *plan,
+        int j)
+{
+    return src + (size_t)(plan->rows ? plan->rows[j] : j) * plan->stride;
+}
+
+// Distance in values between output columns.
+static inline size_t output_stride(const decode_plan *plan)
+{
+    return plan->ld > 0 ? plan->ld : plan->nrow;
+}
+
+// Bytes per output value.
+static inline size_t output_size(const decode_plan *plan)
+{
+    return plan->real ? sizeof(double) : sizeof(int);
+}
+
+// Address of output value 'k' (counted in values, not bytes).
+static inline void *output_at(void *dest, const decode_plan *plan, size_t k)
+{
+    return (char *)dest + k * output_size(plan);
+}
+
+// Returns 'l' (little endian), 'b' (big endian) or 0 (unsupported) for the
+// value of $BYTEORD.
+char byte_order(const char *byteord);
+// Fill in the events and parameters of 'plan' (which must be zeroed) from the
+// text segment 'txt', which must outlive 'plan'.  Returns false if out of
+// memory.
+bool describe_parameters(decode_plan *plan, map_t txt);
+// Index of the parameter named 'name', or -1 if there is none.
+int find_parameter(const decode_plan *plan, const char *name);
+// Decode the 'ncol' parameters in 'cols' (all parameters if 'cols' is NULL),
+// after describe_parameters().  Returns false if out of memory.
+bool make_plan(decode_plan *plan, const int *cols, int ncol);
+// Restrict 'plan' to the events in 'src' passing all 'nfilter' filters.
+// Returns false if out of memory.
+bool filter_rows(decode_plan *plan, const char *src, const row_filter *filters,
+        int nfilter);
+// Free the rows of filter_rows() only, e.g. of a copy of 'plan'.
+void free_rows(decode_plan *plan);
+// Free everything alloc'ed for 'plan' (which may be zeroed).
+void free_plan(decode_plan *plan);
+// Returns NULL if there is no vectorized kernel for 'ncol' 32 bit parameters
+// (stored in the other byte order if 'swap' is set) on this machine.
+decode_kernel_t simd_u32_kernel(int ncol, bool swap, const char **name);
+// Copy what copy_data() needs of 'src' into 'dst', alloc'ed with malloc() so
+// that it may outlive the call that made 'src' (and its TEXT segment, so the
+// parameters are left out).  Returns false if out of memory.
+bool keep_plan(decode_plan *dst, const decode_plan *src);
+// Point 'one' at column 'k' of 'plan' only, e.g. to decode one column at a
+// time.  It shares the arrays of 'plan' so it must not be freed.
+void column_plan(decode_plan *one, const decode_plan *plan, int k);
+// Decode into 'dest', which holds int or double depending on 'plan->real'.
+// Nothing is bounds checked, 'src' must hold the 'ntot' events of 'plan' (see
+// plan_file(), which repairs $TOT to fit the DATA segment).
+void copy_data(void *dest, const char *src, const decode_plan *plan);
+
+#endif
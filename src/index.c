@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lxb.h"
+
+// Directory index of LXB files, see indexLxb().
+//
+// Listing what an archive holds otherwise means opening every file in it.  An
+// index records what there is to know about each file of a directory without
+// reading its events: its size and mtime (which tell when the entry is stale),
+// $TOT, $WELLID, the parameters and where the DATA segment is.  Updating the
+// index only stat()s each file and reads the header and TEXT segment of the
+// files that are new or have changed.  Files that could not be read are kept
+// too, so that they are not read again until they change.
+//
+// The index of a directory is kept in its INDEX_NAME file, all integers in
+// native byte order:
+//
+//   index_header
+//   index_entry[nfile], sorted by (byte-wise) file name
+//   strings: NUL terminated, referred to by their offset in this block
+
+#define INDEX_NAME       ".lxbindex"
+#define INDEX_MAGIC      "LXBINDEX"
+#define INDEX_VERSION    1
+#define INDEX_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;        // INDEX_BYTE_ORDER as written
+    uint32_t nfile;
+    uint32_t unused;
+    int64_t  strings_size;      // the strings follow the entries
+} index_header;
+
+typedef struct {
+    int64_t  size, mtime;       // of the LXB file
+    int64_t  begin_data, end_data;
+    int32_t  events;            // or -1 if the file could not be read
+    int32_t  npar;
+    uint32_t name, well;        // offsets into the strings
+    uint32_t pars, bits;        // $PnN and $PnB of all parameters, comma
+                                // separated
+    char     datatype;          // $DATATYPE
+    char     byte_order;        // see byte_order()
+    char     unused[6];
+} index_entry;
+
+// One file while the index is being updated.  The strings point into the old
+// index or else are alloc'ed ('owned' is set).
+typedef struct {
+    index_entry e;
+    const char *name, *well, *pars, *bits;
+    bool        owned;
+} index_item;
+
+// An index mapped (or read) into memory.
+typedef struct {
+    const char *buf;
+    long        size;
+    bool        mapped;
+    uint32_t    nfile;
+    const char *entries, *strings;
+} lxb_index;
+
+static void index_path(char *buf, size_t len, const char *dir)
+{
+    snprintf(buf, len, "%s/%s", dir, INDEX_NAME);
+}
+
+static void free_index(lxb_index *idx)
+{
+    if (idx->mapped)
+        munmap_file(idx->buf, idx->size);
+    else
+        free((char *)idx->buf);
+    idx->buf = NULL;
+}
+
+// Load the index of 'dir'.  Returns false if there is none (or it is from
+// another version or broken, in which case it is replaced on update).
+static bool load_index(lxb_index *idx, const char *dir)
+{
+    char path[4096];
+    index_path(path, sizeof(path), dir);
+    memset(idx, 0, sizeof(*idx));
+    idx->buf = mmap_file(path, &idx->size);
+    idx->mapped = idx->buf != NULL;
+    if (!idx->buf)
+        idx->buf = read_file(path, &idx->size);
+    if (!idx->buf)
+        return false;
+
+    index_header hdr;
+    bool ok = idx->size >= (long)sizeof(hdr);
+    if (ok) {
+        memcpy(&hdr, idx->buf, sizeof(hdr));
+        uint64_t entries = (uint64_t)hdr.nfile * sizeof(index_entry);
+        ok = memcmp(hdr.magic, INDEX_MAGIC, 8) == 0
+            && hdr.version == INDEX_VERSION
+            && hdr.byte_order == INDEX_BYTE_ORDER
+            && hdr.strings_size > 0 && hdr.strings_size <= UINT32_MAX
+            && sizeof(hdr) + entries + hdr.strings_size
+                == (uint64_t)idx->size;
+    }
+
+    // With the last string terminated, every string is.
+    ok = ok && idx->buf[idx->size - 1] == 0;
+    if (!ok) {
+        free_index(idx);
+        return false;
+    }
+
+    idx->nfile   = hdr.nfile;
+    idx->entries = idx->buf + sizeof(hdr);
+    idx->strings = idx->entries + (size_t)hdr.nfile * sizeof(index_entry);
+    return true;
+}
+
+// Entry 'i' of 'idx' as an item, false if it refers past the strings.
+static bool index_item_at(const lxb_index *idx, uint32_t i, index_item *it)
+{
+    memcpy(&it->e, idx->entries + (size_t)i * sizeof(index_entry),
+            sizeof(index_entry));
+    uint64_t size = idx->size - (idx->strings - idx->buf);
+    if (!(it->e.name < size && it->e.well < size && it->e.pars < size
+                && it->e.bits < size))
+        return false;
+
+    it->name  = idx->strings + it->e.name;
+    it->well  = idx->strings + it->e.well;
+    it->pars  = idx->strings + it->e.pars;
+    it->bits  = idx->strings + it->e.bits;
+    it->owned = false;
+    return true;
+}
+
+// Find 'name' in 'idx' (sorted by name), false if it is not there.
+static bool find_item(const lxb_index *idx, const char *name, index_item *it)
+{
+    uint32_t lo = 0, hi = idx->nfile;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (!index_item_at(idx, mid, it))
+            return false;
+        int cmp = strcmp(it->name, name);
+        if (cmp == 0)
+            return true;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return false;
+}
+
+// Join the $PnN (type 'N') or $PnB (type 'B') of all 'npar' parameters of
+// 'txt' with commas, into alloc'ed memory.
+static char *join_parameters(map_t txt, int npar, char type)
+{
+    par_key key;
+    size_t len = 1;
+    for (int i = 0; i < npar; ++i)
+        len += strlen(map_get(txt, parameter_key(key, i, type))) + 1;
+
+    char *buf = (char *)malloc(len), *p = buf;
+    for (int i = 0; buf && i < npar; ++i) {
+        const char *s = map_get(txt, parameter_key(key, i, type));
+        size_t n = strlen(s);
+        if (i > 0)
+            *p++ = ',';
+        memcpy(p, s, n);
+        p += n;
+    }
+    if (buf)
+        *p = 0;
+
+    return buf;
+}
+
+// Fill in 'it' (with its name, size and mtime set) from the header and TEXT
+// segment of 'path'.  Does not call into R.
+static void describe_file(index_item *it, const char *path, lxb_arena *arena,
+        lxb_log *log)
+{
+    it->e.events = -1;
+    it->owned = true;
+    it->well = it->pars = it->bits = NULL;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        lxb_warn(log, "  Could not read file: %s\n", path);
+        return;
+    }
+    fcs_header hdr;
+    map_t txt = read_header_text(fp, &hdr, arena, path, log);
+    fclose(fp);
+    if (!txt)
+        return;
+
+    decode_plan plan;
+    memset(&plan, 0, sizeof(plan));
+    plan.arena = arena;
+    int64_t begin, end;
+    if (!locate_data(&hdr, txt, &begin, &end)) {
+        lxb_warn(log, "  Bad LXB: could not locate DATA segment in '%s'\n",
+                path);
+    } else if (describe_parameters(&plan, txt)) {
+        check_layout(&plan, data_size(begin, end, it->e.size), path, log);
+        it->e.begin_data = begin;
+        it->e.end_data   = end;
+        it->e.events     = plan.ntot;
+        it->e.npar       = plan.npar;
+        it->e.datatype   = plan.datatype;
+        it->e.byte_order = byte_order(map_get(txt, "$BYTEORD"));
+
+        const char *well = map_get(txt, "$WELLID");
+        it->well = dup2str(well, strlen(well));
+        it->pars = join_parameters(txt, plan.npar, 'N');
+        it->bits = join_parameters(txt, plan.npar, 'B');
+        if (!(it->well && it->pars && it->bits)) {
+            lxb_warn(log, "  Out of memory indexing '%s'\n", path);
+            it->e.events = -1;
+        }
+    } else {
+        lxb_warn(log, "  Out of memory reading parameters of '%s'\n", path);
+    }
+
+    free_plan(&plan);
+    map_free(txt);
+}
+
+static void free_item(index_item *it)
+{
+    if (it->owned) {
+        free((char *)it->well);
+        free((char *)it->pars);
+        free((char *)it->bits);
+    }
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    return strcmp(((const index_item *)a)->name,
+            ((const index_item *)b)->name);
+}
+
+// Strings of 'it' that are not set (e.g. of files that could not be read)
+// are written as empty strings.
+static const char *or_empty(const char *s)
+{
+    return s ? s : "";
+}
+
+// Add 's' to the strings and return its offset.
+static uint32_t add_string(FILE *fp, const char *s, int64_t *size, bool *ok)
+{
+    size_t n = strlen(or_empty(s)) + 1;
+    uint32_t offset = (uint32_t)*size;
+    *ok = *ok && *size + (int64_t)n <= UINT32_MAX
+        && fwrite(or_empty(s), 1, n, fp) == n;
+    *size += n;
+    return offset;
+}
+
+// Write the 'n' items (sorted by name) as the index of 'dir', through a
+// temporary file so that readers never see a partial index.
+static bool write_index(const char *dir, index_item *items, int n)
+{
+    char path[4096], tmp[4096 + 64];
+    index_path(path, sizeof(path), dir);
+    temp_path(tmp, sizeof(tmp), path);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp)
+        return false;
+
+    index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, 8);
+    hdr.version    = INDEX_VERSION;
+    hdr.byte_order = INDEX_BYTE_ORDER;
+    hdr.nfile      = n;
+
+    // The entries refer to the strings, so write the strings after a gap
+    // for the header and entries, then go back and fill them in.
+    long start = (long)(sizeof(hdr) + (size_t)n * sizeof(index_entry));
+    bool ok = fseek(fp, start, SEEK_SET) == 0;
+    for (int i = 0; i < n; ++i) {
+        index_entry *e = &items[i].e;
+        e->name = add_string(fp, items[i].name, &hdr.strings_size, &ok);
+        e->well = add_string(fp, items[i].well, &hdr.strings_size, &ok);
+        e->pars = add_string(fp, items[i].pars, &hdr.strings_size, &ok);
+        e->bits = add_string(fp, items[i].bits, &hdr.strings_size, &ok);
+    }
+    // Never empty, see load_index().
+    add_string(fp, "", &hdr.strings_size, &ok);
+
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0
+        && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (int i = 0; ok && i < n; ++i)
+        ok = fwrite(&items[i].e, sizeof(index_entry), 1, fp) == 1;
+    ok = fclose(fp) == 0 && ok;
+
+#ifdef _WIN32
+    // rename() does not replace existing files on Windows.
+    if (ok)
+        remove(path);
+#endif
+    if (!(ok && rename(tmp, path) == 0)) {
+        remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+static SEXP string_or_na(const char *s)
+{
+    return s && *s ? mkChar(s) : NA_STRING;
+}
+
+// The 'n' items as a list of columns, see index_lxb().
+static SEXP index_columns(const index_item *items, int n)
+{
+    static const char *names[] = {
+        "file", "well", "size", "mtime", "events", "datatype", "byteorder",
+        "parameters", "bits", "begin_data", "end_data"
+    };
+    int ncol = sizeof(names) / sizeof(names[0]);
+
+    SEXP out, colnames;
+    PROTECT(out = allocVector(VECSXP, ncol));
+    PROTECT(colnames = allocVector(STRSXP, ncol));
+    for (int k = 0; k < ncol; ++k)
+        SET_STRING_ELT(colnames, k, mkChar(names[k]));
+    namesgets(out, colnames);
+
+    SEXPTYPE types[] = {
+        STRSXP, STRSXP, REALSXP, REALSXP, INTSXP, STRSXP, STRSXP, STRSXP,
+        STRSXP, REALSXP, REALSXP
+    };
+    for (int k = 0; k < ncol; ++k)
+        SET_VECTOR_ELT(out, k, allocVector(types[k], n));
+
+    for (int i = 0; i < n; ++i) {
+        const index_item *it = &items[i];
+        bool ok = it->e.events >= 0;
+        char datatype[2] = { it->e.datatype, 0 };
+        const char *byteord = it->e.byte_order == 'l' ? "little"
+            : it->e.byte_order == 'b' ? "big" : NULL;
+        SET_STRING_ELT(VECTOR_ELT(out, 0), i, mkChar(it->name));
+        SET_STRING_ELT(VECTOR_ELT(out, 1), i, string_or_na(it->well));
+        REAL(VECTOR_ELT(out, 2))[i] = (double)it->e.size;
+        REAL(VECTOR_ELT(out, 3))[i] = (double)it->e.mtime;
+        INTEGER(VECTOR_ELT(out, 4))[i] = ok ? it->e.events : NA_INTEGER;
+        SET_STRING_ELT(VECTOR_ELT(out, 5), i,
+                string_or_na(ok ? datatype : NULL));
+        SET_STRING_ELT(VECTOR_ELT(out, 6), i,
+                string_or_na(ok ? byteord : NULL));
+        SET_STRING_ELT(VECTOR_ELT(out, 7), i,
+                string_or_na(ok ? it->pars : NULL));
+        SET_STRING_ELT(VECTOR_ELT(out, 8), i,
+                string_or_na(ok ? it->bits : NULL));
+        REAL(VECTOR_ELT(out, 9))[i] = ok ? (double)it->e.begin_data
+            : NA_REAL;
+        REAL(VECTOR_ELT(out, 10))[i] = ok ? (double)it->e.end_data : NA_REAL;
+    }
+
+    UNPROTECT(2);
+    return out;
+}
+
+// Update the index of directory 'inDir' to the files 'inFiles' (names inside
+// 'inDir'), or only read it if 'inFiles' is NULL.  Files are stat()ed and only
+// those that are not in the index with the same size and mtime are read (only
+// their header and TEXT segment).  Files no longer in 'inFiles' are dropped.
+// At most 'inThreads' threads are used if it is not NULL.
+//
+// Returns a list of columns with one row per file, sorted by name, or NULL if
+// 'inFiles' is NULL and there is no index.
+SEXP index_lxb(SEXP inDir, SEXP inFiles, SEXP inThreads)
+{
+    const char *dir = CHAR(STRING_ELT(inDir, 0));
+    lxb_index idx;
+    bool found = load_index(&idx, dir);
+    if (!found && isNull(inFiles)) {
+        warning("No LXB index in '%s'\n", dir);
+        return R_NilValue;
+    }
+
+    int n = isNull(inFiles) ? (int)idx.nfile : LENGTH(inFiles);
+    index_item *items = (index_item *)R_alloc(n + 1, sizeof(index_item));
+    lxb_log *log = (lxb_log *)R_alloc(n + 1, sizeof(lxb_log));
+    memset(items, 0, (n + 1) * sizeof(index_item));
+    memset(log, 0, (n + 1) * sizeof(lxb_log));
+    bool broken = false;
+    for (int i = 0; isNull(inFiles) && i < n; ++i)
+        broken |= !index_item_at(&idx, i, &items[i]);
+    for (int i = 0; !isNull(inFiles) && i < n; ++i)
+        items[i].name = CHAR(STRING_ELT(inFiles, i));
+    if (broken) {
+        free_index(&idx);
+        warning("Bad LXB index in '%s'\n", dir);
+        return R_NilValue;
+    }
+
+    int changed = !found || idx.nfile != (uint32_t)n;
+    if (!isNull(inFiles)) {
+        reset_arenas();
+        int nthreads = thread_limit(threads_arg(inThreads));
+        // Mostly waiting on the file system, as for read_lxb_text().
+#pragma omp parallel for schedule(dynamic) reduction(|:changed) \
+    num_threads(nthreads)
+        for (int i = 0; i < n; ++i) {
+            index_item *it = &items[i];
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", dir, it->name);
+            int64_t size = -1, mtime = -1;
+            file_stat(path, &size, &mtime);
+
+            index_item old;
+            if (found && find_item(&idx, it->name, &old)
+                    && old.e.size == size && old.e.mtime == mtime) {
+                *it = old;
+            } else {
+                it->e.size  = size;
+                it->e.mtime = mtime;
+                describe_file(it, path, thread_arena(), &log[i]);
+                changed = 1;
+            }
+        }
+        qsort(items, n, sizeof(index_item), compare_items);
+    }
+
+    SEXP out;
+    PROTECT(out = index_columns(items, n));
+    bool written = !changed || isNull(inFiles) || write_index(dir, items, n);
+    for (int i = 0; i < n; ++i)
+        free_item(&items[i]);
+    if (found)
+        free_index(&idx);
+
+    for (int i = 0; i < n; ++i)
+        flush_log(&log[i]);
+    if (!written)
+        warning("Could not write LXB index in '%s'\n", dir);
+    UNPROTECT(1);
+    return out;
+}
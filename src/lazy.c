@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include <Rversion.h>
+#include "lxb.h"
+
+// Lazily decoded output, see readLxb(lazy=TRUE).
+//
+// A lazy matrix is an ALTREP integer (or double) vector that keeps the file it
+// was read from (mapped, as by load_file()) and a copy of its decode plan, and
+// decodes each column of the matrix the first time one of its values is read.
+// Columns that are never looked at are never decoded, so reading a file to
+// look at its TEXT segment or a single parameter costs little more than
+// mapping it.  The decoded columns are kept, and the whole matrix is only
+// decoded into an ordinary vector (after which the file is released) if R
+// asks for a pointer to its data, e.g. to modify it.
+//
+// The file stays mapped for as long as the matrix is alive, so it must not be
+// truncated in the meantime.  Lazy matrices are serialized as ordinary ones.
+//
+// ALTREP needs R 3.5.0 or later.  On older versions files are always decoded
+// right away.
+
+#if R_VERSION >= R_Version(3, 5, 0)
+
+#include <R_ext/Altrep.h>
+
+typedef struct {
+    const char *buf;        // the file, mapped unless 'mapped' is false
+    long        size;
+    bool        mapped;
+    const char *data;       // DATA segment, inside 'buf'
+    decode_plan plan;       // see keep_plan()
+    void      **cols;       // decoded columns, NULL until first read
+} lazy_file;
+
+// One class per output type.  data1 is an external pointer to the lazy_file,
+// data2 the decoded vector once it has been expanded.
+static R_altrep_class_t lazy_int_class, lazy_real_class;
+
+static void free_lazy(lazy_file *l)
+{
+    for (int k = 0; l->cols && k < l->plan.ncol; ++k)
+        free(l->cols[k]);
+    free(l->cols);
+    free_plan(&l->plan);
+    if (l->mapped)
+        munmap_file(l->buf, l->size);
+    else
+        free((char *)l->buf);
+    free(l);
+}
+
+static void lazy_finalizer(SEXP ptr)
+{
+    lazy_file *l = (lazy_file *)R_ExternalPtrAddr(ptr);
+    if (l) {
+        free_lazy(l);
+        R_ClearExternalPtr(ptr);
+    }
+}
+
+static lazy_file *lazy_of(SEXP x)
+{
+    return (lazy_file *)R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+// Column 'k' of 'l', decoded if it has not been read before.
+static const void *lazy_column(lazy_file *l, int k)
+{
+    if (!l->cols[k]) {
+        const decode_plan *plan = &l->plan;
+        void *col = malloc((plan->nrow > 0 ? plan->nrow : 1)
+                * output_size(plan));
+        if (!col)
+            error("Out of memory decoding column %d of lazy matrix", k + 1);
+        decode_plan one;
+        column_plan(&one, plan, k);
+        copy_data(col, l->data, &one);
+        l->cols[k] = col;
+    }
+    return l->cols[k];
+}
+
+static void *values_of(SEXP x)
+{
+    return TYPEOF(x) == REALSXP ? (void *)REAL(x) : (void *)INTEGER(x);
+}
+
+static R_xlen_t lazy_length(SEXP x)
+{
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue)
+        return XLENGTH(full);
+    lazy_file *l = lazy_of(x);
+    return (R_xlen_t)l->plan.nrow * l->plan.ncol;
+}
+
+static void *lazy_dataptr(SEXP x, Rboolean writeable)
+{
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue)
+        return values_of(full);
+
+    // Decode the columns that have not been read straight into place.
+    lazy_file *l = lazy_of(x);
+    const decode_plan *plan = &l->plan;
+    size_t nrow = plan->nrow, size = output_size(plan);
+    PROTECT(full = allocVector(plan->real ? REALSXP : INTSXP,
+                (R_xlen_t)nrow * plan->ncol));
+    char *dest = (char *)values_of(full);
+    for (int k = 0; k < plan->ncol; ++k) {
+        char *col = dest + k * nrow * size;
+        if (l->cols[k]) {
+            memcpy(col, l->cols[k], nrow * size);
+        } else {
+            decode_plan one;
+            column_plan(&one, plan, k);
+            copy_data(col, l->data, &one);
+        }
+    }
+
+    R_set_altrep_data2(x, full);
+    lazy_finalizer(R_altrep_data1(x));
+    UNPROTECT(1);
+    return values_of(full);
+}
+
+static const void *lazy_dataptr_or_null(SEXP x)
+{
+    SEXP full = R_altrep_data2(x);
+    return full != R_NilValue ? values_of(full) : NULL;
+}
+
+// Copy the 'n' values from 'i' on into 'buf', column by column.
+static R_xlen_t lazy_region(SEXP x, R_xlen_t i, R_xlen_t n, void *buf)
+{
+    R_xlen_t len = lazy_length(x);
+    if (n > len - i)
+        n = len - i;
+    SEXP full = R_altrep_data2(x);
+    size_t size = TYPEOF(x) == REALSXP ? sizeof(double) : sizeof(int);
+    if (full != R_NilValue) {
+        memcpy(buf, (char *)values_of(full) + i * size, n * size);
+        return n;
+    }
+
+    lazy_file *l = lazy_of(x);
+    R_xlen_t nrow = l->plan.nrow;
+    for (R_xlen_t done = 0; done < n; ) {
+        R_xlen_t at = i + done, j = at % nrow;
+        R_xlen_t m = nrow - j < n - done ? nrow - j : n - done;
+        const char *col = (const char *)lazy_column(l, (int)(at / nrow));
+        memcpy((char *)buf + done * size, col + j * size, m * size);
+        done += m;
+    }
+    return n;
+}
+
+static int lazy_int_elt(SEXP x, R_xlen_t i)
+{
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue)
+        return INTEGER(full)[i];
+    lazy_file *l = lazy_of(x);
+    R_xlen_t nrow = l->plan.nrow;
+    return ((const int *)lazy_column(l, (int)(i / nrow)))[i % nrow];
+}
+
+static double lazy_real_elt(SEXP x, R_xlen_t i)
+{
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue)
+        return REAL(full)[i];
+    lazy_file *l = lazy_of(x);
+    R_xlen_t nrow = l->plan.nrow;
+    return ((const double *)lazy_column(l, (int)(i / nrow)))[i % nrow];
+}
+
+static R_xlen_t lazy_int_region(SEXP x, R_xlen_t i, R_xlen_t n, int *buf)
+{
+    return lazy_region(x, i, n, buf);
+}
+
+static R_xlen_t lazy_real_region(SEXP x, R_xlen_t i, R_xlen_t n,
+        double *buf)
+{
+    return lazy_region(x, i, n, buf);
+}
+
+static Rboolean lazy_inspect(SEXP x, int pre, int deep, int pvec,
+        void (*inspect_subtree)(SEXP, int, int, int))
+{
+    if (R_altrep_data2(x) != R_NilValue) {
+        Rprintf(" lxb lazy (expanded)\n");
+        return TRUE;
+    }
+
+    lazy_file *l = lazy_of(x);
+    int n = 0;
+    for (int k = 0; k < l->plan.ncol; ++k)
+        n += l->cols[k] != NULL;
+    Rprintf(" lxb lazy, %d of %d columns decoded\n", n, l->plan.ncol);
+    return TRUE;
+}
+
+static void set_methods(R_altrep_class_t cls)
+{
+    R_set_altrep_Length_method(cls, lazy_length);
+    R_set_altrep_Inspect_method(cls, lazy_inspect);
+    R_set_altvec_Dataptr_method(cls, lazy_dataptr);
+    R_set_altvec_Dataptr_or_null_method(cls, lazy_dataptr_or_null);
+}
+
+void init_lazy(DllInfo *dll)
+{
+    lazy_int_class = R_make_altinteger_class("lazy_int", "lxb", dll);
+    lazy_real_class = R_make_altreal_class("lazy_real", "lxb", dll);
+    set_methods(lazy_int_class);
+    set_methods(lazy_real_class);
+    R_set_altinteger_Elt_method(lazy_int_class, lazy_int_elt);
+    R_set_altinteger_Get_region_method(lazy_int_class, lazy_int_region);
+    R_set_altreal_Elt_method(lazy_real_class, lazy_real_elt);
+    R_set_altreal_Get_region_method(lazy_real_class, lazy_real_region);
+}
+
+SEXP alloc_lazy(lxb_file *f)
+{
+    lazy_file *l = (lazy_file *)calloc(1, sizeof(lazy_file));
+    if (l)
+        l->cols = (void **)calloc(f->plan.ncol + 1, sizeof(void *));
+    if (!(l && l->cols && keep_plan(&l->plan, &f->plan))) {
+        if (l)
+            free(l->cols);
+        free(l);
+        return R_NilValue;
+    }
+
+    // The file now belongs to the lazy matrix.
+    l->buf    = f->buf;
+    l->size   = f->size;
+    l->mapped = f->mapped;
+    l->data   = f->data;
+    f->buf    = NULL;
+    f->mapped = false;
+
+    SEXP ptr, x, dim;
+    PROTECT(ptr = R_MakeExternalPtr(l, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, lazy_finalizer, TRUE);
+    PROTECT(x = R_new_altrep(l->plan.real ? lazy_real_class : lazy_int_class,
+                ptr, R_NilValue));
+    PROTECT(dim = allocVector(INTSXP, 2));
+    INTEGER(dim)[0] = l->plan.nrow;
+    INTEGER(dim)[1] = l->plan.ncol;
+    setAttrib(x, R_DimSymbol, dim);
+    UNPROTECT(3);
+    return x;
+}
+
+#else
+
+void init_lazy(DllInfo *dll)
+{
+}
+
+SEXP alloc_lazy(lxb_file *f)
+{
+    return R_NilValue;
+}
+
+#endif
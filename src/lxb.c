@@ -1,21 +1,27 @@
-#include <R.h>
-#include <Rinternals.h>
-#include <stdint.h>
-#include <stdbool.h>
+#include <ctype.h>
+#include <stdarg.h>
 #include <string.h>
-#include "map_lib.h"
+#include "lxb.h"
 
-// Max number of parameters in LXB file that we handle
-#define MAX_PAR       99
-// Max chars needed to print MAX_PAR (must be updated when MAX_PAR is!)
-#define MAX_PAR_CHARS 2
 
-typedef struct {
-    int begin_text, end_text;
-    int begin_data, end_data;
-    int begin_analysis, end_analysis;
-} fcs_header;
+void lxb_warn(lxb_log *log, const char *fmt, ...)
+{
+    if (log->n >= MAX_MSG)
+        return;
 
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(log->msg[log->n++], MAX_MSG_LEN, fmt, ap);
+    va_end(ap);
+}
+
+// Must only be called from the main thread.
+void flush_log(lxb_log *log)
+{
+    for (int i = 0; i < log->n; ++i)
+        warning("%s", log->msg[i]);
+    log->n = 0;
+}
 
 char *read_file(const char *filename, long *size)
 {
@@ -51,44 +57,50 @@ char *read_file(const char *filename, long *size)
     return buf;
 }
 
-const char *parameter_key(int n, char type)
+// Parse one blank padded 8 character segment offset from the header.
+// NOTE: sscanf("%8d") cannot be used since it skips blanks *before* counting
+// characters, so it runs into the next field if this one is padded.
+static bool parse_offset(const char *field, int64_t *offset)
 {
-    // Key is of format "$PXY", where len(X) <= MAX_PAR_CHARS, and Y == type,
-    // also include room for null terminator.
-    static char buf[MAX_PAR_CHARS+4];
-    if (n < 0 || n >= MAX_PAR)
-        return "";
+    char buf[9];
+    memcpy(buf, field, 8);
+    buf[8] = 0;
 
-    sprintf(buf, "$P%d%c", n+1, type);
-    return buf;
+    char *end;
+    *offset = strtol(buf, &end, 10);
+    while (*end == ' ')
+        ++end;
+
+    return *end == 0;
 }
 
 bool parse_header(const char *data, long size, fcs_header *hdr,
-        const char *filename)
+        const char *filename, lxb_log *log)
 {
     if (!hdr) return false;
 
     if (size < 58) {
-        warning("  Bad LXB: header data is too small (%lu) in '%s'\n", size,
-                filename);
+        lxb_warn(log, "  Bad LXB: header data is too small (%ld) in '%s'\n",
+                size, filename);
         return false;
     }
 
     if (0 != strncmp(data, "FCS3.0    ", 10)) {
-        warning("  Bad LXB: magic bytes do not match in '%s'\n", filename);
+        lxb_warn(log, "  Bad LXB: magic bytes do not match in '%s'\n",
+                filename);
         return false;
     }
 
     bool ok = true;
-    ok &= sscanf(&data[10], "%8d", &hdr->begin_text);
-    ok &= sscanf(&data[18], "%8d", &hdr->end_text);
-    ok &= sscanf(&data[26], "%8d", &hdr->begin_data);
-    ok &= sscanf(&data[34], "%8d", &hdr->end_data);
-    ok &= sscanf(&data[42], "%8d", &hdr->begin_analysis);
-    ok &= sscanf(&data[50], "%8d", &hdr->end_analysis);
+    ok &= parse_offset(&data[10], &hdr->begin_text);
+    ok &= parse_offset(&data[18], &hdr->end_text);
+    ok &= parse_offset(&data[26], &hdr->begin_data);
+    ok &= parse_offset(&data[34], &hdr->end_data);
+    ok &= parse_offset(&data[42], &hdr->begin_analysis);
+    ok &= parse_offset(&data[50], &hdr->end_analysis);
 
     if (!ok)
-        warning("  Bad LXB: failed to parse segment offsets\n");
+        lxb_warn(log, "  Bad LXB: failed to parse segment offsets\n");
 
     return ok;
 }
@@ -103,65 +115,107 @@ char *dup2str(const void *buf, long size)
     return memcpy(str, buf, size);
 }
 
-map_t parse_text(const char *text, long size, const char *filename)
+// Scans the TEXT segment one keyword or value at a time.  Tokens are copied
+// to 'out' as they are scanned, so the segment is only read once.
+typedef struct {
+    const char *src, *end;      // rest of the TEXT segment
+    char       *out;            // where the next token is copied to
+    char        sep;
+} text_scanner;
+
+// Scan the next token, which is copied NUL terminated and with doubled
+// separators collapsed into one (FCS 3.0 escaping, e.g. with sep='/' the bytes
+// "k//ey/" are the token "k/ey").  Returns NULL at the end of the segment.
+static char *next_token(text_scanner *s)
 {
-    if (size < 2) {
-        warning("  Bad LXB: text segment too small (%lu) in '%s'\n", size,
-                filename);
+    if (s->src >= s->end)
         return NULL;
+
+    char *tok = s->out;
+    const char *p = s->src;
+    for (;;) {
+        const char *q = (const char *)memchr(p, s->sep, s->end - p);
+        if (!q)
+            q = s->end;
+        memcpy(s->out, p, q - p);
+        s->out += q - p;
+        p = q;
+
+        // NOTE: Empty keywords and values are not allowed by FCS 3.0 so a
+        // doubled separator is always an escaped one.
+        if (p + 1 < s->end && p[1] == s->sep) {
+            *s->out++ = s->sep;
+            p += 2;
+        } else {
+            break;
+        }
     }
 
-    map_t m = map_create();
-    char *sep = dup2str(text, 1);
-    char *data = dup2str(text+1, size-1);
-    char *key = strtok(data, sep);
-    while (key) {
-        // FIXME: FCS 3.0 allows the separator character to appear in keys and
-        // values by repeating the separator twice -- this is currently NOT
-        // handled.
-        // For example, if sep='/' then "k//ey/value/" should be parsed as
-        // "k/ey"="value", whereas we parse it as { "k"="", "ey"="value" }.
-        char *val = strtok(NULL, sep);
-        if (!val) break;
+    *s->out++ = 0;
+    s->src = p < s->end ? p + 1 : p;
 
-        map_set(m, key, val);
+    return tok;
+}
 
-        key = strtok(NULL, sep);
+map_t parse_text(const char *text, long size, lxb_arena *arena,
+        const char *filename, lxb_log *log)
+{
+    if (size < 2) {
+        lxb_warn(log, "  Bad LXB: text segment too small (%ld) in '%s'\n",
+                size, filename);
+        return NULL;
     }
 
-    free(data);
-    free(sep);
+    // Keys and values are copied into one buffer owned by the map, which
+    // never needs more room than the segment itself (separators become NULs
+    // and escapes shrink).
+    char *data = (char *)arena_alloc(arena, size);
+    if (!data) {
+        lxb_warn(log, "  Out of memory parsing text segment in '%s'\n",
+                filename);
+        return NULL;
+    }
+    // A keyword and its value rarely take less than 32 bytes
+    map_t m = map_create_in(arena, (int)(size / 32));
+    map_adopt(m, data);
+
+    text_scanner s = { text + 1, text + size, data, text[0] };
+    char *key;
+    while ((key = next_token(&s))) {
+        char *val = next_token(&s);
+        if (!val) break;
+
+        map_set_ref(m, key, val);
+    }
 
     return m;
 }
 
-bool check_par_format(map_t txt, const char *filename)
+bool check_par_format(map_t txt, const char *filename, lxb_log *log)
 {
     int npar = map_get_int(txt, "$PAR");
-    if (npar > MAX_PAR) {
-        warning("  Unsupported LXB: too many parameters (%d) in '%s'\n", npar,
-                filename);
-        return false;
-    }
 
+    // Integers, or single or double precision floats
     const char *data_type = map_get(txt, "$DATATYPE");
-    if (strcasecmp("I", data_type) != 0) {
-        warning("  Unsupported LXB: data is not integral "
-                "($DATATYPE=%s) in '%s'\n", data_type, filename);
+    char type = toupper((unsigned char)*data_type);
+    if (!(strchr("IFD", type) && type && data_type[1] == 0)) {
+        lxb_warn(log, "  Unsupported LXB: data is not integral or floating "
+                "point ($DATATYPE=%s) in '%s'\n", data_type, filename);
         return false;
     }
 
     const char *mode = map_get(txt, "$MODE");
     if (strcasecmp("L", mode) != 0) {
-        warning("  Unsupported LXB: data not in list format "
+        lxb_warn(log, "  Unsupported LXB: data not in list format "
                 "($MODE=%s) in '%s'\n", mode, filename);
         return false;
     }
 
+    // Either byte order is fine, see decode_plan.swap
     const char *byteord = map_get(txt, "$BYTEORD");
-    if (strcmp("1,2,3,4", byteord) != 0) {
-        warning("  Unsupported LXB: data not in little endian format "
-                "($BYTEORD=%s) in '%s'\n", byteord, filename);
+    if (!byte_order(byteord)) {
+        lxb_warn(log, "  Unsupported LXB: data neither in little nor big "
+                "endian format ($BYTEORD=%s) in '%s'\n", byteord, filename);
         return false;
     }
 
@@ -169,16 +223,23 @@ bool check_par_format(map_t txt, const char *filename)
     if (*unicode) {
         // FIXME: Support Unicode.  We try to parse the data even if the text
         // segment contains Unicode characters, so don't return false here.
-        warning("  Unsupported LXB: Unicode flag detected,"
+        lxb_warn(log, "  Unsupported LXB: Unicode flag detected,"
                 " output may be corrupted in '%s'\n", filename);
     }
 
+    par_key buf;
     for (int i = 0; i < npar; ++i) {
-        const char *key = parameter_key(i, 'B');
+        const char *key = parameter_key(buf, i, 'B');
         int bits = map_get_int(txt, key);
-        if (bits % 8 != 0 || bits < 8) {
-            warning("  Unsupported LXB: parameter %d is not a multiple of 8 "
-                    "(%s=%d) in '%s'\n", i, key, bits, filename);
+        if (bits % 8 != 0 || bits < 8 || bits > 64) {
+            lxb_warn(log, "  Unsupported LXB: parameter %d is not a "
+                    "multiple of 8 (%s=%d) in '%s'\n", i, key, bits, filename);
+            return false;
+        }
+        if ((type == 'F' && bits != 32) || (type == 'D' && bits != 64)) {
+            lxb_warn(log, "  Unsupported LXB: parameter %d does not match "
+                    "$DATATYPE=%s (%s=%d) in '%s'\n", i, data_type, key,
+                    bits, filename);
             return false;
         }
     }
@@ -186,32 +247,75 @@ bool check_par_format(map_t txt, const char *filename)
     return true;
 }
 
+// Find the DATA segment.  Files with offsets that do not fit in 8 digits
+// store zeros in the header, in which case the offsets are given by the
+// $BEGINDATA and $ENDDATA keywords instead.
+bool locate_data(const fcs_header *hdr, map_t txt, int64_t *begin,
+        int64_t *end)
+{
+    *begin = hdr->begin_data;
+    *end   = hdr->end_data;
+    if (*begin == 0 && *end == 0) {
+        *begin = strtoll(map_get(txt, "$BEGINDATA"), NULL, 10);
+        *end   = strtoll(map_get(txt, "$ENDDATA"), NULL, 10);
+    }
+
+    return *end - *begin > 0 && *begin > 0;
+}
+
+int64_t data_size(int64_t begin, int64_t end, int64_t size)
+{
+    // The FCS standard has 'end' point at the last byte of DATA, but not all
+    // writers follow it, so count one more and rely on the file size to catch
+    // those that point past it.
+    int64_t n = end - begin + 1;
+    return n < size - begin ? n : size - begin;
+}
+
 // Return text segment in alloc'ed memory (must map_free()) and pointer to data
-// segment inside 'buf' (do *not* free()).
+// segment inside 'buf' (do *not* free()), and its size in bytes.
 // FIXME: this is potentially very confusing.
-void parse_segments(char *buf, long size, map_t *outTxt, char **outData,
-        const char *filename)
+// The phases are timed into 'stats' (if not NULL).
+void parse_segments(const char *buf, long size, lxb_arena *arena,
+        lxb_stats *stats, map_t *outTxt, const char **outData,
+        long *outDataSize, const char *filename, lxb_log *log)
 {
     if (outTxt)  *outTxt = NULL;
     if (outData) *outData = NULL;
+    if (outDataSize) *outDataSize = 0;
 
     fcs_header hdr;
-    bool ok = parse_header(buf, size, &hdr, filename);
+    double t = stats_start();
+    bool ok = parse_header(buf, size, &hdr, filename, log);
+    stats_stop(stats, PHASE_HEADER, t);
     if (!ok)
         return;
 
     long txt_size = hdr.end_text - hdr.begin_text;
     if (!(txt_size > 0 && hdr.begin_text > 0 && hdr.end_text <= size)) {
-        warning("  Bad LXB: could not locate TEXT segment in '%s'\n",
+        lxb_warn(log, "  Bad LXB: could not locate TEXT segment in '%s'\n",
                 filename);
         return;
     }
 
-    map_t txt = parse_text(buf + hdr.begin_text, txt_size, filename);
-    if (!(txt && check_par_format(txt, filename))) {
+    t = stats_start();
+    arena_mark mark = arena_usage(arena);
+    map_t txt = parse_text(buf + hdr.begin_text, txt_size, arena, filename,
+            log);
+    stats_stop(stats, PHASE_TEXT, t);
+    stats_arena(stats, PHASE_TEXT, arena, mark);
+
+    t = stats_start();
+    ok = txt && check_par_format(txt, filename, log);
+    stats_stop(stats, PHASE_CHECK, t);
+    if (!ok) {
         map_free(txt);
         return;
     }
+
+    int64_t begin_data, end_data;
+    bool found = locate_data(&hdr, txt, &begin_data, &end_data);
+
     if (outTxt) {
         *outTxt = txt;
     } else {
@@ -219,51 +323,19 @@ void parse_segments(char *buf, long size, map_t *outTxt, char **outData,
         map_free(txt);
     }
 
-    long data_size = hdr.end_data - hdr.begin_data;
-    if (!(data_size > 0 && hdr.begin_data > 0 && hdr.end_data <= size)) {
-        warning("  Bad LXB: could not locate DATA segment in '%s'\n",
+    // A DATA segment cut short by the end of the file is fine, only the events
+    // that are there are read, see check_layout().
+    if (!(found && begin_data < size)) {
+        lxb_warn(log, "  Bad LXB: could not locate DATA segment in '%s'\n",
                 filename);
         return;
     }
-    if (outData) *outData = buf + hdr.begin_data;
+    if (outData) *outData = buf + begin_data;
+    if (outDataSize) *outDataSize = data_size(begin_data, end_data, size);
 
     return;
 }
 
-void copy_data(int *dest, char *src, map_t txt)
-{
-    int par_mask[MAX_PAR];
-    int par_size[MAX_PAR];
-
-    int npar = map_get_int(txt, "$PAR");
-    int ntot = map_get_int(txt, "$TOT");
-
-    for (int i = 0; i < npar; ++i) {
-        int bits      = map_get_int(txt, parameter_key(i, 'B'));
-        int range     = map_get_int(txt, parameter_key(i, 'R'));
-        unsigned mask = ((unsigned)-1) >> (8*sizeof(unsigned)-bits);
-
-        // NOTE: MagPIX LXBs may have negative PnR parameters.  Not sure how to
-        // interpret this so just ignore such entries.
-        par_mask[i] = mask;
-        if (range > 0)
-            par_mask[i] &= range-1;
-        par_size[i] = bits >> 3;
-    }
-
-    // NOTE: R stores matrices in column-major order but the data in the LXB
-    // file is in row-major order so copy the data transposed.
-    char *p = src;
-    for (int j = 0; j < ntot; ++j) {
-        for (int i = 0; i < npar; ++i) {
-            // NOTE: Here it is assumed that both the machine and the LXB is
-            // little-endian!
-            dest[i*ntot + j] = *(int*)p & par_mask[i];
-            p += par_size[i];
-        }
-    }
-}
-
 struct set_value_s {
     SEXP v;
     int  n;
@@ -305,60 +377,357 @@ SEXP map_to_Rlist(map_t map)
     return vals;
 }
 
-SEXP read_lxb(SEXP inFilename, SEXP inTextFlag)
+// Fill in options from the arguments passed from R.  The strings in 'opts'
+// point into the R objects so these must be kept alive while 'opts' is used.
+//
+// 'inGates' is a named list of (min, max) pairs.
+void get_opts(lxb_opts *opts, SEXP inColumns, SEXP inFilter, SEXP inGates)
 {
-    const char *filename = CHAR(STRING_ELT(inFilename, 0));
-    int textFlag = *LOGICAL(inTextFlag);
+    opts->ncolumns = -1;
+    opts->columns  = NULL;
+    if (!isNull(inColumns)) {
+        opts->ncolumns = LENGTH(inColumns);
+        opts->columns  = (const char **)R_alloc(opts->ncolumns + 1,
+                sizeof(const char *));
+        for (int i = 0; i < opts->ncolumns; ++i)
+            opts->columns[i] = CHAR(STRING_ELT(inColumns, i));
+    }
+
+    opts->filter = *LOGICAL(inFilter);
+
+    opts->ngates = isNull(inGates) ? 0 : LENGTH(inGates);
+    SEXP names = getAttrib(inGates, R_NamesSymbol);
+    opts->gate_columns = (const char **)R_alloc(opts->ngates + 1,
+            sizeof(const char *));
+    opts->gate_lo = (double *)R_alloc(opts->ngates + 1, sizeof(double));
+    opts->gate_hi = (double *)R_alloc(opts->ngates + 1, sizeof(double));
+    for (int i = 0; i < opts->ngates; ++i) {
+        double *range = REAL(VECTOR_ELT(inGates, i));
+        opts->gate_columns[i] = CHAR(STRING_ELT(names, i));
+        opts->gate_lo[i] = range[0];
+        opts->gate_hi[i] = range[1];
+    }
+
+    opts->cache_dir = NULL;
+    opts->compact   = false;
+    opts->lazy      = false;
+    opts->threads   = 0;
+}
+
+// Look up the parameter index of each column in 'opts' by its $PnN name.
+// Columns not in the file are skipped.  Returns the number of columns found,
+// 'cols' must have room for 'ncolumns'.
+int select_columns(const decode_plan *plan, const lxb_opts *opts, int *cols,
+        const char *filename, lxb_log *log)
+{
+    int ncol = 0;
+    for (int k = 0; k < opts->ncolumns; ++k) {
+        int i = find_parameter(plan, opts->columns[k]);
+        if (i >= 0)
+            cols[ncol++] = i;
+        else
+            lxb_warn(log, "  Column '%s' not found in '%s'\n",
+                    opts->columns[k], filename);
+    }
+
+    return ncol;
+}
+
+// Collect the event filters in 'opts' that apply to this file.  As before,
+// 'filter' is only applied if the file has both a RID and a DBL parameter,
+// whereas gates on parameters not in the file are skipped with a warning.
+// Returns the number of filters, 'filters' must have room for 'ngates' + 2.
+int select_filters(const decode_plan *plan, const lxb_opts *opts,
+        row_filter *filters, const char *filename, lxb_log *log)
+{
+    int nfilter = 0;
+
+    int rid = find_parameter(plan, "RID");
+    int dbl = find_parameter(plan, "DBL");
+    if (opts->filter && rid >= 0 && dbl >= 0) {
+        row_filter f = { rid, true, 0, 0 };
+        filters[nfilter++] = f;
+        f.par = dbl;
+        filters[nfilter++] = f;
+    }
+
+    for (int k = 0; k < opts->ngates; ++k) {
+        int i = find_parameter(plan, opts->gate_columns[k]);
+        if (i < 0) {
+            lxb_warn(log, "  Gate column '%s' not found in '%s'\n",
+                    opts->gate_columns[k], filename);
+            continue;
+        }
+
+        row_filter f = { i, false, opts->gate_lo[k], opts->gate_hi[k] };
+        filters[nfilter++] = f;
+    }
+
+    return nfilter;
+}
+
+// After this the kernels can read any of the 'ntot' events of 'plan' without
+// checking bounds, however broken the file.
+void check_layout(decode_plan *plan, int64_t size,
+        const char *filename, lxb_log *log)
+{
+    if (plan->ntot < 0) {
+        lxb_warn(log, "  Bad LXB: $TOT=%d in '%s'\n", plan->ntot, filename);
+        plan->ntot = 0;
+    }
+
+    // Without parameters there is nothing to read anyway.
+    if (plan->stride == 0)
+        return;
+    int64_t nevents = size > 0 ? size / plan->stride : 0;
+    if (nevents < plan->ntot) {
+        lxb_warn(log, "  Bad LXB: DATA segment of '%s' only holds %d of "
+                "%d events\n", filename, (int)nevents, plan->ntot);
+        plan->ntot = (int)nevents;
+    }
+}
+
+// Set up 'plan' (which must be zeroed) for decoding the columns selected by
+// 'opts' from a DATA segment of 'size' bytes, see check_layout().  Returns
+// false if out of memory.
+bool plan_file(decode_plan *plan, map_t txt, int64_t size,
+        const lxb_opts *opts, const char *filename, lxb_log *log)
+{
+    bool ok = describe_parameters(plan, txt);
+    if (ok)
+        check_layout(plan, size, filename, log);
+    if (ok && opts->ncolumns < 0) {
+        ok = make_plan(plan, NULL, 0);
+    } else if (ok) {
+        int *cols = (int *)arena_alloc(plan->arena,
+                (opts->ncolumns + 1) * sizeof(int));
+        ok = cols != NULL;
+        if (ok)
+            ok = make_plan(plan, cols,
+                    select_columns(plan, opts, cols, filename, log));
+        arena_free(plan->arena, cols);
+    }
+
+    if (!ok)
+        lxb_warn(log, "  Out of memory reading parameters of '%s'\n",
+                filename);
+    return ok;
+}
+
+// Read and parse one file.  Does not call into R so it is safe to call from
+// worker threads; any warnings end up in 'f->log'.
+void load_file(lxb_file *f, const lxb_opts *opts)
+{
+    // Decode straight from the page cache if possible, only fall back to
+    // reading the whole file into memory if it cannot be mapped.
+    // NOTE: The pages of a mapped file are only read as they are touched, so
+    // most of that time is counted in the phases that follow.
+    double t = stats_start();
+    f->buf = mmap_file(f->filename, &f->size);
+    f->mapped = f->buf != NULL;
+    if (!f->buf)
+        f->buf = read_file(f->filename, &f->size);
+    stats_stop(&f->stats, PHASE_READ, t);
+    if (!f->buf) {
+        lxb_warn(&f->log, "  Could not read file: %s\n", f->filename);
+        return;
+    }
+    f->stats.bytes = f->size;
+    stats_alloc(&f->stats, PHASE_READ, 1, f->size);
 
     long size;
-    char *buf = read_file(filename, &size);
-    if (!buf) {
-        warning("  Could not read file: %s\n", filename);
-        return R_NilValue;
+    parse_segments(f->buf, f->size, f->arena, &f->stats, &f->txt, &f->data,
+            &size, f->filename, &f->log);
+    if (!f->data)
+        return;
+
+    t = stats_start();
+    arena_mark mark = arena_usage(f->arena);
+    f->plan.arena = f->arena;
+    bool ok = plan_file(&f->plan, f->txt, size, opts, f->filename, &f->log);
+    stats_stop(&f->stats, PHASE_PLAN, t);
+    stats_arena(&f->stats, PHASE_PLAN, f->arena, mark);
+    if (!ok) {
+        f->data = NULL;
+        return;
+    }
+
+    // Events are filtered before the output is allocated so that it can be
+    // sized to the events that are actually kept.
+    t = stats_start();
+    mark = arena_usage(f->arena);
+    row_filter *filters = (row_filter *)arena_alloc(f->arena,
+            (opts->ngates + 2) * sizeof(row_filter));
+    int nfilter = filters ? select_filters(&f->plan, opts, filters,
+            f->filename, &f->log) : 0;
+    if (!(filters && filter_rows(&f->plan, f->data, filters, nfilter))) {
+        lxb_warn(&f->log, "  Out of memory filtering events in '%s'\n",
+                f->filename);
+        f->data = NULL;
     }
+    arena_free(f->arena, filters);
+    stats_stop(&f->stats, PHASE_FILTER, t);
+    stats_arena(&f->stats, PHASE_FILTER, f->arena, mark);
+
+    if (f->data && opts->compact)
+        f->compact = compact_width(&f->plan);
+    f->lazy = f->data && opts->lazy;
+}
+
+void free_file(lxb_file *f)
+{
+    free_plan(&f->plan);
+    if (f->txt)
+        map_free(f->txt);
+    if (f->mapped)
+        munmap_file(f->buf, f->size);
+    else
+        free((char *)f->buf);
+    cache_free(f);
+    f->txt  = NULL;
+    f->buf  = NULL;
+    f->data = NULL;
+}
 
-    map_t txt;      // alloc'ed by parse_segments(), must map_free()
-    char *data;     // will point inside 'buf', do not free()
-    parse_segments(buf, size, &txt, &data, filename);
-    if (!txt) {
+// Allocate a 'nrow' by 'ncol' matrix stored in 'compact' bytes per value, or
+// as ints (or doubles if 'real' is set) if 'compact' is 0, and set '*dest' to
+// its data.
+static SEXP alloc_values(bool real, int nrow, int ncol, int compact,
+        void **dest)
+{
+    SEXP mat, dim;
+    if (!compact) {
+        mat = allocMatrix(real ? REALSXP : INTSXP, nrow, ncol);
+        *dest = real ? (void *)REAL(mat) : (void *)INTEGER(mat);
+        return mat;
+    }
+
+    PROTECT(mat = alloc_compact((R_xlen_t)nrow * ncol, compact, dest));
+    PROTECT(dim = allocVector(INTSXP, 2));
+    INTEGER(dim)[0] = nrow;
+    INTEGER(dim)[1] = ncol;
+    setAttrib(mat, R_DimSymbol, dim);
+    UNPROTECT(2);
+    return mat;
+}
+
+// Name the columns of 'mat' after the $PnN parameters of 'plan'.
+static void name_columns(SEXP mat, const decode_plan *plan)
+{
+    int ncol = plan->ncol;
+    SEXP colnames;
+    PROTECT(colnames = allocVector(STRSXP, ncol));
+    for (int k = 0; k < ncol; ++k)
+        SET_STRING_ELT(colnames, k, mkChar(plan->par[plan->col[k]].name));
+
+    // Set dimnames attribute on output matrix
+    SEXP dimnames;
+    PROTECT(dimnames = allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, R_NilValue);
+    SET_VECTOR_ELT(dimnames, 1, colnames);
+    dimnamesgets(mat, dimnames);
+
+    UNPROTECT(2);
+}
+
+// Same as alloc_matrix() but stored in 'compact' bytes per value if not 0.
+static SEXP alloc_data(const decode_plan *plan, int nrow, int compact,
+        void **dest)
+{
+    SEXP mat;
+    PROTECT(mat = alloc_values(plan->real, nrow, plan->ncol, compact, dest));
+    name_columns(mat, plan);
+    UNPROTECT(1);
+
+    return mat;
+}
+
+// Allocate output matrix to be nrow rows times one column per column in
+// 'plan', with column names taken from the $PnN parameters.
+SEXP alloc_matrix(const decode_plan *plan, int nrow)
+{
+    void *dest;
+    return alloc_data(plan, nrow, 0, &dest);
+}
+
+// Matrix of the cache hit 'f'.  Unless it is compact the mapped entry itself
+// is the matrix (see map_vector()), so '*dest' is NULL and nothing is copied,
+// otherwise it is copied into '*dest' as for alloc_values().
+static SEXP cached_values(lxb_file *f, void **dest)
+{
+    lxb_cache *c = &f->cache;
+    SEXP mat = f->compact ? R_NilValue : map_vector(c->buf, c->buf_size,
+            c->data, (R_xlen_t)c->nrow * c->ncol, c->real);
+    if (isNull(mat))
+        return alloc_values(c->real, c->nrow, c->ncol, f->compact, dest);
+
+    // The names stay valid as long as the matrix, and 'c' no longer owns
+    // the mapping.
+    c->buf = NULL;
+    f->stats.events = c->nrow;
+    SEXP dim;
+    PROTECT(mat);
+    PROTECT(dim = allocVector(INTSXP, 2));
+    INTEGER(dim)[0] = c->nrow;
+    INTEGER(dim)[1] = c->ncol;
+    setAttrib(mat, R_DimSymbol, dim);
+    UNPROTECT(2);
+    return mat;
+}
+
+static SEXP make_output(lxb_file *f, int textFlag, void **dest)
+{
+    *dest = NULL;
+    if (f->cache.data) {
+        // Cache hit, there is no text segment (cache is not used with text).
+        SEXP out, outnames, mat;
+        PROTECT(out = allocVector(VECSXP, 1));
+        PROTECT(outnames = allocVector(STRSXP, 1));
+        PROTECT(mat = cached_values(f, dest));
+        SEXP colnames, dimnames;
+        PROTECT(colnames = allocVector(STRSXP, f->cache.ncol));
+        PROTECT(dimnames = allocVector(VECSXP, 2));
+        SET_VECTOR_ELT(dimnames, 1, colnames);
+        setAttrib(mat, R_DimNamesSymbol, dimnames);
+        for (int k = 0; k < f->cache.ncol; ++k)
+            SET_STRING_ELT(colnames, k, mkChar(f->cache.names[k]));
+
+        SET_VECTOR_ELT(out, 0, mat);
+        SET_STRING_ELT(outnames, 0, mkChar("data"));
+        namesgets(out, outnames);
+        if (*dest)
+            stats_alloc(&f->stats, PHASE_ALLOC, 1, (int64_t)f->cache.nrow
+                    * f->cache.ncol * (f->compact ? f->compact
+                        : f->cache.real ? sizeof(double) : sizeof(int)));
+        UNPROTECT(5);
+        return out;
+    }
+
+    if (!f->txt) {
         // Failed to read text segment, so we can only bail and return Nil.
         // Note however that whenever text segment was parsed we continue on
         // and return the text segment if requested.
-        free(buf);
         return R_NilValue;
     }
 
+    map_t txt = f->txt;
     SEXP out, outnames;
     int outLen = textFlag ? 2 : 1;
     PROTECT(out = allocVector(VECSXP, outLen));
     PROTECT(outnames = allocVector(STRSXP, outLen));
 
-    if (data) {
-        // Allocate output matrix to be ntot rows times npar columns
-        int npar = map_get_int(txt, "$PAR");
-        int ntot = map_get_int(txt, "$TOT");
-        SEXP mat;
-        PROTECT(mat = allocMatrix(INTSXP, ntot, npar));
-
-        // Initialize vector with column names (taken from $PxN parameter)
-        SEXP colnames;
-        PROTECT(colnames = allocVector(STRSXP, npar));
-        for (int i = 0; i < npar; ++i) {
-            const char *label = map_get(txt, parameter_key(i, 'N'));
-            SET_STRING_ELT(colnames, i, mkChar(label));
-        }
-
-        // Set dimnames attribute on output matrix
-        SEXP dimnames;
-        PROTECT(dimnames = allocVector(VECSXP, 2));
-        SET_VECTOR_ELT(dimnames, 0, R_NilValue);
-        SET_VECTOR_ELT(dimnames, 1, colnames);
-        dimnamesgets(mat, dimnames);
-
-        copy_data(INTEGER(mat), data, txt);
-
+    // A lazy matrix takes over the file and is decoded as it is read, so
+    // there is nothing to copy_data() into (or alloc) now.
+    SEXP lazy = f->data && f->lazy ? alloc_lazy(f) : R_NilValue;
+    if (!isNull(lazy)) {
+        SET_VECTOR_ELT(out, 0, lazy);
+        name_columns(lazy, &f->plan);
+    } else if (f->data) {
+        SEXP mat = alloc_data(&f->plan, f->plan.nrow, f->compact, dest);
         SET_VECTOR_ELT(out, 0, mat);
-        UNPROTECT(3);
+        stats_alloc(&f->stats, PHASE_ALLOC, 1, (int64_t)f->plan.nrow
+                * f->plan.ncol * (f->compact ? f->compact
+                    : output_size(&f->plan)));
     } else {
         SET_VECTOR_ELT(out, 0, R_NilValue);
     }
@@ -374,9 +743,72 @@ SEXP read_lxb(SEXP inFilename, SEXP inTextFlag)
     namesgets(out, outnames);
 
     UNPROTECT(2);
-    if (txt)
-        map_free(txt);
-    free(buf);
 
     return out;
 }
+
+// Allocate the R object returned for one file.  The data matrix is left
+// uninitialized and '*dest' is set to point at it so that the caller can
+// copy_data() into it (possibly on another thread); '*dest' is NULL if there
+// is no data segment, or if the matrix is lazy (see lazy.c), which takes over
+// the file.  Must only be called from the main thread.
+SEXP alloc_output(lxb_file *f, int textFlag, void **dest)
+{
+    double t = stats_start();
+    SEXP out = make_output(f, textFlag, dest);
+    stats_stop(&f->stats, PHASE_ALLOC, t);
+
+    return out;
+}
+
+const char *file_well_id(const lxb_file *f)
+{
+    const char *well = f->txt ? map_get(f->txt, "$WELLID") : f->cache.well;
+    return well && *well ? well : NULL;
+}
+
+// Decode 'f' into 'dest', counting it in 'f->stats'.
+void decode_file(lxb_file *f, void *dest)
+{
+    double t = stats_start();
+    if (f->compact)
+        decode_compact(f, dest);
+    else
+        copy_data(dest, f->data, &f->plan);
+    stats_stop(&f->stats, PHASE_DECODE, t);
+    f->stats.events += f->plan.nrow;
+}
+
+SEXP read_lxb(SEXP inFilename, SEXP inTextFlag, SEXP inColumns,
+        SEXP inFilter, SEXP inGates)
+{
+    lxb_file f = { CHAR(STRING_ELT(inFilename, 0)) };
+    int textFlag = *LOGICAL(inTextFlag);
+    lxb_opts opts;
+    get_opts(&opts, inColumns, inFilter, inGates);
+
+    reset_arenas();
+    f.arena = thread_arena();
+    load_file(&f, &opts);
+    flush_log(&f.log);
+
+    void *dest;
+    SEXP out;
+    PROTECT(out = alloc_output(&f, textFlag, &dest));
+    if (dest)
+        decode_file(&f, dest);
+
+    free_file(&f);
+    stats_record(&f, 1);
+    UNPROTECT(1);
+
+    return out;
+}
+
+// Called by R when the package is loaded.
+void R_init_lxb(DllInfo *dll)
+{
+    init_compact(dll);
+    init_lazy(dll);
+    init_columns(dll);
+}
@@ -0,0 +1,236 @@
+#ifndef LXB_H
+#define LXB_H
+
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "map_lib.h"
+#include "decode.h"
+
+// Max number of warnings kept per file, and max length of each warning
+#define MAX_MSG       4
+#define MAX_MSG_LEN   256
+
+typedef struct {
+    int64_t begin_text, end_text;
+    int64_t begin_data, end_data;
+    int64_t begin_analysis, end_analysis;
+} fcs_header;
+
+// R must not be called from worker threads so warnings are collected here and
+// passed on to R by the main thread (see flush_log()).
+typedef struct {
+    int  n;
+    char msg[MAX_MSG][MAX_MSG_LEN];
+} lxb_log;
+
+// Options shared by all files read in one call, see get_opts().
+typedef struct {
+    int          ncolumns;  // number of 'columns', or -1 to decode all
+    const char **columns;   // $PnN names of the parameters to decode
+
+    bool         filter;    // drop events where RID or DBL is zero
+
+    int          ngates;    // keep events where gate_lo <= value <= gate_hi
+    const char **gate_columns;
+    double      *gate_lo, *gate_hi;
+
+    const char  *cache_dir; // directory of decoded files, or NULL
+    bool         compact;   // narrow integer output, see compact.c
+    bool         lazy;      // decode on first read, see lazy.c
+    int          threads;   // max threads to read with, or 0 for all
+} lxb_opts;
+
+// A file found in the on-disk cache, see cache_load().
+typedef struct {
+    int64_t     size, mtime;    // of the LXB file
+    uint64_t    key;            // or 0 if not looked up
+    const char *buf;            // mapped cache entry, or NULL on a miss
+    long        buf_size;
+    int         nrow, ncol;
+    bool        real;           // double (or int) data
+    const char **names;         // column names, point into 'buf'
+    const char *well;           // $WELLID of the file (may be empty)
+    const void *data;           // column-major, points into 'buf'
+} lxb_cache;
+
+// Phases of reading a file, timed when enabled by lxbStats().
+typedef enum {
+    PHASE_READ,     // mmap_file() or read_file()
+    PHASE_HEADER,   // parse_header()
+    PHASE_TEXT,     // parse_text()
+    PHASE_CHECK,    // check_par_format()
+    PHASE_PLAN,     // plan_file()
+    PHASE_FILTER,   // select_filters() and filter_rows()
+    PHASE_CACHE,    // cache_load(), cache_store() and copying cached data
+    PHASE_ALLOC,    // allocating the R output
+    PHASE_DECODE,   // copy_data()
+    NPHASE
+} lxb_phase;
+
+// Timings (in seconds) and counters of one file, see stats.c.
+typedef struct {
+    double  time[NPHASE];
+    int64_t alloc[NPHASE];  // bytes alloc'ed (or mapped) in each phase
+    int64_t nalloc[NPHASE]; // number of allocations (or mappings) in each
+    int64_t bytes;          // read from the file (or cache entry)
+    int64_t events;         // decoded (or copied from the cache)
+} lxb_stats;
+
+// One LXB file on its way through the reader.  Everything up to and including
+// copy_data() only touches this struct, so different files may be processed
+// concurrently.  What it allocates comes from 'arena' (see arena.h), except
+// for a file read into memory by read_file().
+typedef struct {
+    const char *filename;
+    const char *buf;    // mapped by mmap_file() (or alloc'ed by read_file()
+                        // if 'mapped' is false), released by free_file()
+    long        size;
+    bool        mapped;
+    map_t       txt;    // alloc'ed by parse_segments(), freed by free_file()
+    const char *data;   // points inside 'buf', do not free()
+    decode_plan plan;   // only valid if 'data' is set
+    lxb_cache   cache;
+    lxb_log     log;
+    lxb_stats   stats;
+    lxb_arena  *arena;  // of the thread loading the file, or NULL
+    int         compact;    // bytes per value of compact output, or 0
+    bool        lazy;       // output is a lazy matrix (if possible)
+} lxb_file;
+
+void lxb_warn(lxb_log *log, const char *fmt, ...);
+void flush_log(lxb_log *log);
+
+// Set by lxbStats(), only while no files are being read.
+extern bool lxb_stats_on;
+// Start timing a phase, returns 0 if timing is off.
+double stats_start(void);
+// Add the time since 'start' to phase 'phase' of 'stats' (which may be NULL).
+void stats_stop(lxb_stats *stats, lxb_phase phase, double start);
+// Count 'count' allocations (or mappings) of 'bytes' in all in phase 'phase'
+// of 'stats' (which may be NULL).
+void stats_alloc(lxb_stats *stats, lxb_phase phase, int64_t count,
+        int64_t bytes);
+// Same as stats_alloc() for what was alloc'ed from 'arena' since
+// arena_usage() returned 'mark'.
+void stats_arena(lxb_stats *stats, lxb_phase phase, const lxb_arena *arena,
+        arena_mark mark);
+// Keep the stats of 'n' files read by one call, main thread only.
+void stats_record(const lxb_file *files, int n);
+
+const char *mmap_file(const char *filename, long *size);
+// Read all of 'filename' into alloc'ed memory, or NULL if it cannot be read.
+char *read_file(const char *filename, long *size);
+void munmap_file(const char *buf, long size);
+// Name of a temporary file next to 'path' that no other thread or process
+// uses, to write 'path' through (and rename() it to 'path') so that readers
+// never see a partial file.
+void temp_path(char *buf, size_t len, const char *path);
+// Hint that 'filename' will be read soon, does not wait for it to be read.
+void prefetch_file(const char *filename);
+
+char *dup2str(const void *buf, long size);
+bool parse_header(const char *data, long size, fcs_header *hdr,
+        const char *filename, lxb_log *log);
+map_t parse_text(const char *text, long size, lxb_arena *arena,
+        const char *filename, lxb_log *log);
+bool check_par_format(map_t txt, const char *filename, lxb_log *log);
+bool locate_data(const fcs_header *hdr, map_t txt, int64_t *begin,
+        int64_t *end);
+// Bytes of the DATA segment from 'begin' to 'end' (of locate_data()) that are
+// inside a file of 'size' bytes.
+int64_t data_size(int64_t begin, int64_t end, int64_t size);
+map_t read_header_text(FILE *fp, fcs_header *hdr, lxb_arena *arena,
+        const char *filename, lxb_log *log);
+map_t load_text(const char *filename, lxb_arena *arena, lxb_log *log);
+// Leaves 2 objects PROTECTed.
+SEXP map_to_Rlist(map_t map);
+
+void get_opts(lxb_opts *opts, SEXP inColumns, SEXP inFilter, SEXP inGates);
+int select_columns(const decode_plan *plan, const lxb_opts *opts, int *cols,
+        const char *filename, lxb_log *log);
+int select_filters(const decode_plan *plan, const lxb_opts *opts,
+        row_filter *filters, const char *filename, lxb_log *log);
+// Make sure the DATA segment of 'size' bytes holds the $TOT events of 'plan'
+// (as laid out by describe_parameters()), or else lower its 'ntot' to the
+// whole events that it does hold.
+void check_layout(decode_plan *plan, int64_t size, const char *filename,
+        lxb_log *log);
+bool plan_file(decode_plan *plan, map_t txt, int64_t size,
+        const lxb_opts *opts, const char *filename, lxb_log *log);
+void load_file(lxb_file *f, const lxb_opts *opts);
+void load_files(lxb_file *files, int n, const lxb_opts *opts);
+// Number of threads to read with, see 'opts->threads'.
+int thread_count(const lxb_opts *opts);
+// Number of threads to use, at most 'threads' if it is positive.
+int thread_limit(int threads);
+// Value of 'opts->threads' for a 'threads' argument from R, NULL for all.
+int threads_arg(SEXP inThreads);
+void free_file(lxb_file *f);
+// Size and modification time (in seconds) of 'filename', false if unknown.
+bool file_stat(const char *filename, int64_t *size, int64_t *mtime);
+// Returns true (and sets 'f->cache') if 'f' is in 'opts->cache_dir'.
+bool cache_load(lxb_file *f, const lxb_opts *opts);
+// Add 'f' decoded into 'data' (compact if 'f->compact' is set) to the cache,
+// after a miss in cache_load().
+void cache_store(const lxb_file *f, const lxb_opts *opts, const void *data);
+void cache_free(lxb_file *f);
+
+SEXP alloc_output(lxb_file *f, int textFlag, void **dest);
+// $WELLID of 'f' from its TEXT segment (or cache entry), NULL if none.
+const char *file_well_id(const lxb_file *f);
+// Well (or file) name of each of the 'n' files, given their $WELLIDs 'ids'
+// (which may be NULL), and the order to list them in (0-based), see wells.c.
+SEXP well_names(const char **filenames, const char **ids, int n, int *order);
+void decode_file(lxb_file *f, void *dest);
+// True if 'a' and 'b' decode to the same columns, by name and type.
+bool same_columns(const decode_plan *a, const decode_plan *b);
+SEXP alloc_matrix(const decode_plan *plan, int nrow);
+// Lay out the loaded 'files' of a plate one after another in well order
+// (file pos[k] being the k:th well), file i starting at row first[i] of
+// '*nrow'.  Files with other columns than the first one that could be read are
+// skipped with a warning.  Returns the plan of that file, NULL if none.
+const decode_plan *layout_plate(lxb_file *files, int n, const int *pos,
+        R_xlen_t *first, R_xlen_t *nrow);
+// Decode the files laid out by layout_plate() into 'dest' (int or double if
+// 'real'), after a first column holding the 1-based well slot[i] + 1 of each
+// event of file i, and free them.  Uses the threads of 'opts'.
+void decode_plate(lxb_file *files, int n, const int *slot,
+        const R_xlen_t *first, R_xlen_t nrow, bool real, void *dest,
+        const lxb_opts *opts);
+
+// Register the ALTREP classes of compact.c when the package is loaded.
+void init_compact(DllInfo *dll);
+// Bytes per value (1 or 2) of compact output for 'plan', or 0 if too wide
+// (or not integer).
+int compact_width(const decode_plan *plan);
+// Same as compact_width() but for the 'n' decoded values in 'data'.
+int compact_data_width(const int *data, size_t n);
+// Allocate an integer vector of length 'n' stored in 'width' bytes per value,
+// '*dest' is set to its storage.
+SEXP alloc_compact(R_xlen_t n, int width, void **dest);
+void narrow_ints(void *dest, const int *src, size_t n, int width);
+void widen_ints(int *dest, const void *src, size_t n, int width);
+// Same as copy_data() but into the compact storage of 'f', see compact.c.
+void decode_compact(lxb_file *f, void *dest);
+
+// Register the ALTREP classes of lazy.c when the package is loaded.
+void init_lazy(DllInfo *dll);
+// Allocate a matrix that decodes 'f' as its columns are read, which takes over
+// the mapped (or read) file of 'f'.  Returns NULL (R_NilValue) if lazy output
+// is not supported or out of memory.
+SEXP alloc_lazy(lxb_file *f);
+
+// Register the ALTREP classes of columns.c when the package is loaded.
+void init_columns(DllInfo *dll);
+// Vector of the 'n' values (double if 'real', else int) at 'data' inside the
+// mapping 'buf' of 'size' bytes, which it takes over and unmaps once R is done
+// with it.  Returns NULL (R_NilValue), leaving 'buf' to the caller, if it
+// cannot be mapped (before R 3.5.0 or out of memory).
+SEXP map_vector(const char *buf, long size, const void *data, R_xlen_t n,
+        bool real);
+
+#endif
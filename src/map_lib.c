@@ -30,83 +30,196 @@
 // Modifications to the original library (c) 2012 Bjorn Winckler, and released
 // under the same license as above.
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "map_lib.h"
 
+// Entries are kept in insertion order (which is the order map_fold() visits
+// them in) and indexed by an open-addressing hash table with linear probing.
+// Keys are compared case-insensitively.
+//
+// Strings passed to map_set() are copied into blocks owned by the map whereas
+// map_set_ref() stores the pointers as-is, so that e.g. the TEXT segment can
+// be tokenized in place and handed over to the map with map_adopt().
+//
+// A map created by map_create_in() allocates everything from its arena, so
+// that many short-lived maps reuse the same memory.
+
+// Initial number of entries and hash slots (slots must be a power of 2)
+#define MAP_INIT_CAP   32
+#define MAP_INIT_SLOTS 64
+// Min size of the blocks strings passed to map_set() get copied into
+#define MAP_BLOCK_SIZE 4096
+
+struct map_entry {
+    const char *name;
+    const char *value;
+    unsigned    hash;
+};
+
 struct map_s {
-    struct map_s *nxt;
-    char *name;
-    char *value;
+    struct map_entry *entries;
+    int len, cap;
+
+    // Index+1 into 'entries' (0 marks an empty slot)
+    int *slots;
+    int nslots;
+
+    // Buffers freed by map_free(), and space left in the current block
+    void **owned;
+    int nowned, capowned;
+    char *block;
+    size_t block_left;
+
+    lxb_arena *arena;   // or NULL for malloc()
 };
 
 
+static unsigned hash_key(const char *key)
+{
+    // FNV-1a on lower case characters
+    unsigned h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; ++p) {
+        h ^= (unsigned)tolower(*p);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Return slot of 'key', or of the empty slot where it would be inserted.
+static int find_slot(map_t m, const char *key, unsigned hash)
+{
+    int mask = m->nslots - 1;
+    for (int s = hash & mask; ; s = (s + 1) & mask) {
+        int idx = m->slots[s];
+        if (!idx)
+            return s;
+
+        struct map_entry *e = &m->entries[idx-1];
+        if (e->hash == hash && !strcasecmp(key, e->name))
+            return s;
+    }
+}
+
+static void grow_slots(map_t m)
+{
+    arena_free(m->arena, m->slots);
+    m->nslots *= 2;
+    m->slots = (int *)arena_calloc(m->arena, m->nslots * sizeof(int));
+
+    int mask = m->nslots - 1;
+    for (int i = 0; i < m->len; ++i) {
+        int s = m->entries[i].hash & mask;
+        while (m->slots[s])
+            s = (s + 1) & mask;
+        m->slots[s] = i + 1;
+    }
+}
+
 map_t map_create()
 {
-    map_t m;
-    m = (map_t)malloc(sizeof(struct map_s));
-    m->name = NULL;
-    m->value = NULL;
-    m->nxt = NULL;
+    return map_create_in(NULL, 0);
+}
+
+map_t map_create_in(lxb_arena *arena, int size_hint)
+{
+    map_t m = (map_t)arena_calloc(arena, sizeof(struct map_s));
+    m->arena = arena;
+    m->cap = MAP_INIT_CAP;
+    m->nslots = MAP_INIT_SLOTS;
+    // Growing an arena map leaves the old arrays behind until the reset
+    while (m->cap < size_hint) {
+        m->cap *= 2;
+        m->nslots *= 2;
+    }
+    m->entries = (struct map_entry *)arena_alloc(arena,
+            m->cap * sizeof(struct map_entry));
+    m->slots = (int *)arena_calloc(arena, m->nslots * sizeof(int));
     return m;
 }
 
 void map_free(map_t m)
 {
-    map_t map = m;
-    while (map) {
-        if (map->name) free(map->name);
-        if (map->value) free(map->value);
-        map_t tofree = map;
-        map = map->nxt;
-        free(tofree);
+    if (!m) return;
+
+    lxb_arena *arena = m->arena;
+    for (int i = 0; i < m->nowned; ++i)
+        arena_free(arena, m->owned[i]);
+    arena_free(arena, m->owned);
+    arena_free(arena, m->slots);
+    arena_free(arena, m->entries);
+    arena_free(arena, m);
+}
+
+void map_adopt(map_t m, void *buf)
+{
+    if (m->nowned == m->capowned) {
+        int cap = m->capowned ? 2*m->capowned : 8;
+        m->owned = (void **)arena_realloc(m->arena, m->owned,
+                m->capowned * sizeof(void *), cap * sizeof(void *));
+        m->capowned = cap;
     }
+    m->owned[m->nowned++] = buf;
 }
 
-void map_set(map_t m, const char *key, const char *value)
+static const char *copy_str(map_t m, const char *str)
+{
+    size_t size = strlen(str) + 1;
+    if (size > m->block_left) {
+        size_t block = size > MAP_BLOCK_SIZE ? size : MAP_BLOCK_SIZE;
+        m->block = (char *)arena_alloc(m->arena, block);
+        m->block_left = block;
+        map_adopt(m, m->block);
+    }
+
+    char *dst = memcpy(m->block, str, size);
+    m->block += size;
+    m->block_left -= size;
+    return dst;
+}
+
+void map_set_ref(map_t m, const char *key, const char *value)
 {
-    map_t map;
-
-    if (m->name == NULL) {
-        m->name = (char *)malloc(strlen(key)+1);
-        strcpy(m->name, key);
-        m->value = (char *)malloc(strlen(value)+1);
-        strcpy(m->value, value);
-        m->nxt = NULL;
+    unsigned hash = hash_key(key);
+    int s = find_slot(m, key, hash);
+    if (m->slots[s]) {
+        // Key exists: replace value but keep position of key
+        m->entries[m->slots[s]-1].value = value;
         return;
     }
-    for (map = m; ; map = map->nxt) {
-        if (!strcasecmp(key, map->name)) {
-            if (map->value != NULL) {
-                free(map->value);
-                map->value = (char *)malloc(strlen(value)+1);
-                strcpy(map->value, value);
-                return;
-            }
-        }
-        if (map->nxt == NULL) {
-            map->nxt = (map_t)malloc(sizeof(struct map_s));
-            map = map->nxt;
-            map->name = (char *)malloc(strlen(key)+1);
-            strcpy(map->name, key);
-            map->value = (char *)malloc(strlen(value)+1);
-            strcpy(map->value, value);
-            map->nxt = NULL;
-            return;
-        }
+
+    if (m->len == m->cap) {
+        m->entries = (struct map_entry *)arena_realloc(m->arena, m->entries,
+                m->cap * sizeof(struct map_entry),
+                2 * m->cap * sizeof(struct map_entry));
+        m->cap *= 2;
     }
+    struct map_entry *e = &m->entries[m->len++];
+    e->name  = key;
+    e->value = value;
+    e->hash  = hash;
+    m->slots[s] = m->len;
+
+    // Keep load factor at or below 1/2
+    if (2*m->len > m->nslots)
+        grow_slots(m);
+}
+
+void map_set(map_t m, const char *key, const char *value)
+{
+    // Only copy the key if it is not already in the map
+    unsigned hash = hash_key(key);
+    int idx = m->slots[find_slot(m, key, hash)];
+    const char *name = idx ? m->entries[idx-1].name : copy_str(m, key);
+    map_set_ref(m, name, copy_str(m, value));
 }
 
 const char *map_get(map_t m, const char *key)
 {
-    map_t map;
-    for (map = m; map != NULL; map = map->nxt) {
-        if (!strcasecmp(key, map->name)) {
-            return map->value;
-        }
-    }
-    return "";
+    int idx = m->slots[find_slot(m, key, hash_key(key))];
+    return idx ? m->entries[idx-1].value : "";
 }
 
 int map_get_int(map_t m, const char *key)
@@ -114,24 +227,16 @@ int map_get_int(map_t m, const char *key)
     return atoi(map_get(m, key));
 }
 
-// Enable tail recursive call optimization with -foptimize-sibling-calls
 void map_fold(map_t m, fold_func_t f, void *seed)
 {
     if (!m) return;
 
     // NOTE: As a side-effect 'f' will update 'seed'.
-    f(m->name, m->value, seed);
-    map_fold(m->nxt, f, seed);
-}
-
-static void map_length_f(const char *key, const char *value, int *x)
-{
-    ++(*x);
+    for (int i = 0; i < m->len; ++i)
+        f(m->entries[i].name, m->entries[i].value, seed);
 }
 
 int map_length(map_t m)
 {
-    int z = 0;
-    map_fold(m, (fold_func_t)map_length_f, (void*)&z);
-    return z;
+    return m ? m->len : 0;
 }
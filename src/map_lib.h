@@ -33,6 +33,8 @@
 #ifndef MAP_LIB_H
 #define MAP_LIB_H
 
+#include "arena.h"
+
 struct map_s;
 
 typedef struct map_s *map_t;
@@ -40,8 +42,18 @@ typedef struct map_iter_s *map_iter_t;
 
 
 map_t       map_create();
+// Same as map_create() but all memory of the map (including buffers passed to
+// map_adopt()) comes from 'arena', see arena.h.  Room is made for
+// 'size_hint' keys up front.
+map_t       map_create_in(lxb_arena *arena, int size_hint);
 void        map_free(map_t m);
 void        map_set(map_t m, const char *key, const char *value);
+// Same as map_set() but store 'key' and 'value' without copying them, so they
+// must stay valid for as long as the map is used.
+void        map_set_ref(map_t m, const char *key, const char *value);
+// Hand over ownership of malloc'ed 'buf' (or alloc'ed from the arena of the
+// map) to the map, it is freed by map_free().
+void        map_adopt(map_t m, void *buf);
 const char *map_get(map_t m, const char *key);
 int         map_get_int(map_t m, const char *key);
 
@@ -0,0 +1,134 @@
+#include <limits.h>
+
+// NOTE: System headers must come before the R headers pulled in by "lxb.h"
+// since the latter remap a number of common (Windows) identifiers.
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "lxb.h"
+
+#ifdef _WIN32
+#define process_id() ((unsigned long)GetCurrentProcessId())
+#else
+#define process_id() ((unsigned long)getpid())
+#endif
+
+void temp_path(char *buf, size_t len, const char *path)
+{
+    // The pid tells processes apart (which may share the directory) and the
+    // counter threads (and files) within one.
+    static unsigned counter = 0;
+    unsigned n;
+#pragma omp atomic capture
+    n = counter++;
+    snprintf(buf, len, "%s.%lu.%u.tmp", path, process_id(), n);
+}
+
+// Map the whole file read-only into memory.  Returns NULL if the file could
+// not be mapped, in which case the caller should fall back to read_file().
+// The mapping must be released with munmap_file().
+#ifdef _WIN32
+
+const char *mmap_file(const char *filename, long *size)
+{
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER filesize;
+    if (!GetFileSizeEx(file, &filesize) || filesize.QuadPart <= 0
+            || filesize.QuadPart > LONG_MAX) {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return NULL;
+
+    // The view keeps the mapping (and file) alive so handles can be closed.
+    const char *buf = (const char *)MapViewOfFile(mapping, FILE_MAP_READ,
+            0, 0, 0);
+    CloseHandle(mapping);
+    if (!buf)
+        return NULL;
+
+    if (size)
+        *size = (long)filesize.QuadPart;
+
+    return buf;
+}
+
+void munmap_file(const char *buf, long size)
+{
+    if (buf)
+        UnmapViewOfFile(buf);
+}
+
+// NOTE: Windows has no equivalent that works on a file that is not mapped
+// yet, and FILE_FLAG_SEQUENTIAL_SCAN already reads ahead aggressively once
+// it is.
+void prefetch_file(const char *filename)
+{
+}
+
+#else
+
+const char *mmap_file(const char *filename, long *size)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0
+            || st.st_size > LONG_MAX) {
+        close(fd);
+        return NULL;
+    }
+
+    void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+        return NULL;
+
+#ifdef MADV_SEQUENTIAL
+    // Header and TEXT are read once, DATA is swept front to back.
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    if (size)
+        *size = (long)st.st_size;
+
+    return (const char *)buf;
+}
+
+void munmap_file(const char *buf, long size)
+{
+    if (buf)
+        munmap((void *)buf, size);
+}
+
+void prefetch_file(const char *filename)
+{
+#if defined(POSIX_FADV_WILLNEED)
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    // Starts reading the whole file into the page cache in the background.
+    // The pages stay cached after the file is closed.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
+}
+
+#endif
@@ -0,0 +1,303 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "decode.h"
+
+// Vectorized kernels for the all-32-bit layout.
+//
+// Each kernel transposes tiles of W events x W parameters in registers, masks
+// them and stores one vector per output column.  Events are handled in blocks
+// of BLOCK so that every output column is written a few whole cache lines at a
+// time instead of one int at a time.  Parameters and events that do not fill
+// a tile are handled by the scalar loop.
+//
+// Files in the other byte order are handled by the same kernels, which then
+// reverse the bytes of each loaded vector with a byte shuffle (a shift and
+// word shuffle with SSE2, which has no byte shuffle).  'swap' is always a
+// constant so each kernel is compiled once per byte order.
+//
+// SSE2 (x86-64) and NEON (AArch64) are always available on their platforms,
+// AVX2 is only used if the CPU supports it (checked at run-time).
+
+// Events per block (a multiple of all tile sizes)
+#define BLOCK 64
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_SSE2 1
+#include <immintrin.h>
+// NOTE: GCC on Windows does not align the stack for 32 byte AVX spills.
+#if !defined(_WIN32)
+#define HAVE_AVX2 1
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+static inline uint32_t load_u32(const char *p, bool swap)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    if (swap)
+        v = v << 24 | (v & 0xff00) << 8 | (v >> 8 & 0xff00) | v >> 24;
+    return v;
+}
+
+// Parameters [i0, ncol) of events [j0, j1)
+static inline void scalar_tile(int *dest, const char *src,
+        const decode_plan *plan, int i0, int j0, int j1, bool swap)
+{
+    size_t ld = output_stride(plan);
+    for (int j = j0; j < j1; ++j) {
+        const char *p = event_ptr(src, plan, j);
+        for (int i = i0; i < plan->ncol; ++i)
+            dest[i*ld + j] = load_u32(p + 4*i, swap) & plan->mask[i];
+    }
+}
+
+#if HAVE_SSE2
+
+static inline __m128i bswap_epi32(__m128i x)
+{
+    // Swap the bytes of each 16 bit word, then the words of each 32 bit word.
+    x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1);
+}
+
+#elif HAVE_NEON
+
+static inline uint32x4_t bswap_u32(uint32x4_t x)
+{
+    return vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(x)));
+}
+
+#endif
+
+#if HAVE_SSE2 || HAVE_NEON
+
+// Parameters [i, i+4) of events [j, j+4)
+static inline void tile4(int *dest, const char *src, const decode_plan *plan,
+        int i, int j, bool swap)
+{
+    size_t ld = output_stride(plan);
+    int *d = dest + i*ld + j;
+#define ROW(r) (event_ptr(src, plan, j + (r)) + 4*i)
+
+#if HAVE_SSE2
+    __m128i r0 = _mm_loadu_si128((const __m128i *)ROW(0));
+    __m128i r1 = _mm_loadu_si128((const __m128i *)ROW(1));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)ROW(2));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)ROW(3));
+    if (swap) {
+        r0 = bswap_epi32(r0);
+        r1 = bswap_epi32(r1);
+        r2 = bswap_epi32(r2);
+        r3 = bswap_epi32(r3);
+    }
+
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    const unsigned *m = &plan->mask[i];
+    _mm_storeu_si128((__m128i *)(d), _mm_and_si128(
+                _mm_unpacklo_epi64(t0, t1), _mm_set1_epi32(m[0])));
+    _mm_storeu_si128((__m128i *)(d +   ld), _mm_and_si128(
+                _mm_unpackhi_epi64(t0, t1), _mm_set1_epi32(m[1])));
+    _mm_storeu_si128((__m128i *)(d + 2*ld), _mm_and_si128(
+                _mm_unpacklo_epi64(t2, t3), _mm_set1_epi32(m[2])));
+    _mm_storeu_si128((__m128i *)(d + 3*ld), _mm_and_si128(
+                _mm_unpackhi_epi64(t2, t3), _mm_set1_epi32(m[3])));
+#else
+    uint32x4_t r0 = vld1q_u32((const uint32_t *)ROW(0));
+    uint32x4_t r1 = vld1q_u32((const uint32_t *)ROW(1));
+    uint32x4_t r2 = vld1q_u32((const uint32_t *)ROW(2));
+    uint32x4_t r3 = vld1q_u32((const uint32_t *)ROW(3));
+    if (swap) {
+        r0 = bswap_u32(r0);
+        r1 = bswap_u32(r1);
+        r2 = bswap_u32(r2);
+        r3 = bswap_u32(r3);
+    }
+
+    uint32x4x2_t a = vtrnq_u32(r0, r1);
+    uint32x4x2_t b = vtrnq_u32(r2, r3);
+
+    const unsigned *m = &plan->mask[i];
+    vst1q_u32((uint32_t *)(d), vandq_u32(vcombine_u32(
+                vget_low_u32(a.val[0]), vget_low_u32(b.val[0])),
+                vdupq_n_u32(m[0])));
+    vst1q_u32((uint32_t *)(d + ld), vandq_u32(vcombine_u32(
+                vget_low_u32(a.val[1]), vget_low_u32(b.val[1])),
+                vdupq_n_u32(m[1])));
+    vst1q_u32((uint32_t *)(d + 2*ld), vandq_u32(vcombine_u32(
+                vget_high_u32(a.val[0]), vget_high_u32(b.val[0])),
+                vdupq_n_u32(m[2])));
+    vst1q_u32((uint32_t *)(d + 3*ld), vandq_u32(vcombine_u32(
+                vget_high_u32(a.val[1]), vget_high_u32(b.val[1])),
+                vdupq_n_u32(m[3])));
+#endif
+#undef ROW
+}
+
+static inline void decode_x4(int *dest, const char *src,
+        const decode_plan *plan, bool swap)
+{
+    int ncol = plan->ncol, nrow = plan->nrow;
+    int ntiled = nrow & ~3, ptiled = ncol & ~3;
+
+    for (int jb = 0; jb < ntiled; jb += BLOCK) {
+        int je = jb + BLOCK < ntiled ? jb + BLOCK : ntiled;
+        for (int i = 0; i < ptiled; i += 4)
+            for (int j = jb; j < je; j += 4)
+                tile4(dest, src, plan, i, j, swap);
+        scalar_tile(dest, src, plan, ptiled, jb, je, swap);
+    }
+    scalar_tile(dest, src, plan, 0, ntiled, nrow, swap);
+}
+
+static void decode_u32_x4(int *dest, const char *src,
+        const decode_plan *plan)
+{
+    decode_x4(dest, src, plan, false);
+}
+
+static void decode_u32_x4_swap(int *dest, const char *src,
+        const decode_plan *plan)
+{
+    decode_x4(dest, src, plan, true);
+}
+
+#endif
+
+#if HAVE_AVX2
+
+// Parameters [i, i+8) of events [j, j+8)
+__attribute__((target("avx2")))
+static inline void tile8(int *dest, const char *src, const decode_plan *plan,
+        int i, int j, bool swap)
+{
+    size_t ld = output_stride(plan);
+    int *d = dest + i*ld + j;
+#define ROW(r) ((const __m256i *)(event_ptr(src, plan, j + (r)) + 4*i))
+
+    __m256i r0 = _mm256_loadu_si256(ROW(0));
+    __m256i r1 = _mm256_loadu_si256(ROW(1));
+    __m256i r2 = _mm256_loadu_si256(ROW(2));
+    __m256i r3 = _mm256_loadu_si256(ROW(3));
+    __m256i r4 = _mm256_loadu_si256(ROW(4));
+    __m256i r5 = _mm256_loadu_si256(ROW(5));
+    __m256i r6 = _mm256_loadu_si256(ROW(6));
+    __m256i r7 = _mm256_loadu_si256(ROW(7));
+#undef ROW
+
+    if (swap) {
+        const __m256i rev = _mm256_setr_epi8(
+                3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        r0 = _mm256_shuffle_epi8(r0, rev);
+        r1 = _mm256_shuffle_epi8(r1, rev);
+        r2 = _mm256_shuffle_epi8(r2, rev);
+        r3 = _mm256_shuffle_epi8(r3, rev);
+        r4 = _mm256_shuffle_epi8(r4, rev);
+        r5 = _mm256_shuffle_epi8(r5, rev);
+        r6 = _mm256_shuffle_epi8(r6, rev);
+        r7 = _mm256_shuffle_epi8(r7, rev);
+    }
+
+    // Transpose within 128 bit lanes, after which the low lane of uK holds
+    // parameter K and the high lane parameter K+4 (of 4 events each)...
+    __m256i t0 = _mm256_unpacklo_epi32(r0, r1);
+    __m256i t1 = _mm256_unpackhi_epi32(r0, r1);
+    __m256i t2 = _mm256_unpacklo_epi32(r2, r3);
+    __m256i t3 = _mm256_unpackhi_epi32(r2, r3);
+    __m256i t4 = _mm256_unpacklo_epi32(r4, r5);
+    __m256i t5 = _mm256_unpackhi_epi32(r4, r5);
+    __m256i t6 = _mm256_unpacklo_epi32(r6, r7);
+    __m256i t7 = _mm256_unpackhi_epi32(r6, r7);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    // ...so swap lanes between the first and last four events.
+#define STORE8(k, a, b, sel) \
+    _mm256_storeu_si256((__m256i *)(d + (k)*ld), _mm256_and_si256( \
+                _mm256_permute2x128_si256(a, b, sel), \
+                _mm256_set1_epi32(plan->mask[i+(k)])))
+    STORE8(0, u0, u4, 0x20);
+    STORE8(1, u1, u5, 0x20);
+    STORE8(2, u2, u6, 0x20);
+    STORE8(3, u3, u7, 0x20);
+    STORE8(4, u0, u4, 0x31);
+    STORE8(5, u1, u5, 0x31);
+    STORE8(6, u2, u6, 0x31);
+    STORE8(7, u3, u7, 0x31);
+#undef STORE8
+}
+
+__attribute__((target("avx2")))
+static inline void decode_x8(int *dest, const char *src,
+        const decode_plan *plan, bool swap)
+{
+    int ncol = plan->ncol, nrow = plan->nrow;
+    int ntiled = nrow & ~7, p8 = ncol & ~7, p4 = ncol & ~3;
+
+    for (int jb = 0; jb < ntiled; jb += BLOCK) {
+        int je = jb + BLOCK < ntiled ? jb + BLOCK : ntiled;
+        for (int i = 0; i < p8; i += 8)
+            for (int j = jb; j < je; j += 8)
+                tile8(dest, src, plan, i, j, swap);
+        for (int i = p8; i < p4; i += 4)
+            for (int j = jb; j < je; j += 4)
+                tile4(dest, src, plan, i, j, swap);
+        scalar_tile(dest, src, plan, p4, jb, je, swap);
+    }
+    scalar_tile(dest, src, plan, 0, ntiled, nrow, swap);
+}
+
+__attribute__((target("avx2")))
+static void decode_u32_x8(int *dest, const char *src,
+        const decode_plan *plan)
+{
+    decode_x8(dest, src, plan, false);
+}
+
+__attribute__((target("avx2")))
+static void decode_u32_x8_swap(int *dest, const char *src,
+        const decode_plan *plan)
+{
+    decode_x8(dest, src, plan, true);
+}
+
+#endif
+
+decode_kernel_t simd_u32_kernel(int ncol, bool swap, const char **name)
+{
+#if HAVE_AVX2
+    __builtin_cpu_init();
+    if (ncol >= 8 && __builtin_cpu_supports("avx2")) {
+        *name = swap ? "u32-avx2-swap" : "u32-avx2";
+        return swap ? decode_u32_x8_swap : decode_u32_x8;
+    }
+#endif
+#if HAVE_SSE2
+    if (ncol >= 4) {
+        *name = swap ? "u32-sse2-swap" : "u32-sse2";
+        return swap ? decode_u32_x4_swap : decode_u32_x4;
+    }
+#elif HAVE_NEON
+    if (ncol >= 4) {
+        *name = swap ? "u32-neon-swap" : "u32-neon";
+        return swap ? decode_u32_x4_swap : decode_u32_x4;
+    }
+#endif
+    return NULL;
+}
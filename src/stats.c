@@ -0,0 +1,199 @@
+// clock_gettime()
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// NOTE: System headers must come before the R headers pulled in by "lxb.h"
+// since the latter remap a number of common (Windows) identifiers.
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "lxb.h"
+
+// Opt-in instrumentation of the readers.
+//
+// While enabled every phase of reading a file is timed and counted in the
+// 'stats' of its lxb_file, by whichever thread runs the phase, along with the
+// memory each phase allocates: the mapped (or read) file, what comes from the
+// arena of the thread (see arena.h) and the output.  After each
+// call the stats of all files are appended to 'records' (on the main thread).
+// lxbStats() returns the records as a data frame.  When disabled the readers
+// only test 'lxb_stats_on' once per phase.
+
+bool lxb_stats_on = false;
+
+static const char *phase_names[NPHASE] = {
+    "read", "header", "text", "check", "plan", "filter", "cache", "alloc",
+    "decode"
+};
+
+typedef struct {
+    char     *filename;
+    lxb_stats stats;
+} file_record;
+
+static file_record *records = NULL;
+static int nrecords = 0, max_records = 0;
+
+// Monotonic time in seconds.
+static double now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#endif
+}
+
+double stats_start(void)
+{
+    return lxb_stats_on ? now() : 0;
+}
+
+void stats_stop(lxb_stats *stats, lxb_phase phase, double start)
+{
+    if (lxb_stats_on && stats)
+        stats->time[phase] += now() - start;
+}
+
+void stats_alloc(lxb_stats *stats, lxb_phase phase, int64_t count,
+        int64_t bytes)
+{
+    if (lxb_stats_on && stats) {
+        stats->nalloc[phase] += count;
+        stats->alloc[phase] += bytes;
+    }
+}
+
+void stats_arena(lxb_stats *stats, lxb_phase phase, const lxb_arena *arena,
+        arena_mark mark)
+{
+    arena_mark now = arena_usage(arena);
+    stats_alloc(stats, phase, (int64_t)(now.count - mark.count),
+            (int64_t)(now.bytes - mark.bytes));
+}
+
+void stats_record(const lxb_file *files, int n)
+{
+    if (!lxb_stats_on)
+        return;
+
+    if (nrecords + n > max_records) {
+        int max = 2 * (nrecords + n);
+        file_record *r = (file_record *)realloc(records,
+                max * sizeof(file_record));
+        if (!r) {
+            warning("Out of memory recording stats, stats are incomplete");
+            return;
+        }
+        records = r;
+        max_records = max;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        file_record *r = &records[nrecords++];
+        r->filename = dup2str(files[i].filename, strlen(files[i].filename));
+        r->stats = files[i].stats;
+    }
+}
+
+static void clear_records(void)
+{
+    for (int i = 0; i < nrecords; ++i)
+        free(records[i].filename);
+    free(records);
+    records = NULL;
+    nrecords = max_records = 0;
+}
+
+// Turn instrumentation on or off according to 'inEnable'.  Turning it on
+// clears all records.  Returns the previous setting.
+SEXP enable_lxb_stats(SEXP inEnable)
+{
+    bool was_on = lxb_stats_on;
+    lxb_stats_on = *LOGICAL(inEnable) == TRUE;
+    if (lxb_stats_on && !was_on)
+        clear_records();
+
+    return ScalarLogical(was_on);
+}
+
+// Return the records as a named list of columns: 'file', one column of
+// seconds per phase, then 'bytes', 'events', 'allocated' and 'allocations'
+// (in all phases), then one column of bytes allocated per phase
+// ('<phase>.alloc') and one of the number of allocations per phase
+// ('<phase>.nalloc').  Records are cleared afterwards if 'inReset' is set.
+SEXP read_lxb_stats(SEXP inReset)
+{
+    int ncol = 3 * NPHASE + 5;
+    SEXP out, names;
+    PROTECT(out = allocVector(VECSXP, ncol));
+    PROTECT(names = allocVector(STRSXP, ncol));
+
+    SEXP files = allocVector(STRSXP, nrecords);
+    SET_VECTOR_ELT(out, 0, files);
+    SET_STRING_ELT(names, 0, mkChar("file"));
+    for (int i = 0; i < nrecords; ++i)
+        SET_STRING_ELT(files, i, mkChar(records[i].filename
+                    ? records[i].filename : ""));
+
+    for (int p = 0; p < NPHASE; ++p) {
+        SEXP col = allocVector(REALSXP, nrecords);
+        SET_VECTOR_ELT(out, p + 1, col);
+        SET_STRING_ELT(names, p + 1, mkChar(phase_names[p]));
+        for (int i = 0; i < nrecords; ++i)
+            REAL(col)[i] = records[i].stats.time[p];
+    }
+
+    // Counters are doubles since they may not fit in an R integer.
+    static const char *counter_names[4] = {
+        "bytes", "events", "allocated", "allocations"
+    };
+    for (int k = 0; k < 4; ++k) {
+        SEXP col = allocVector(REALSXP, nrecords);
+        SET_VECTOR_ELT(out, NPHASE + 1 + k, col);
+        SET_STRING_ELT(names, NPHASE + 1 + k, mkChar(counter_names[k]));
+        for (int i = 0; i < nrecords; ++i) {
+            const lxb_stats *s = &records[i].stats;
+            int64_t allocated = 0, allocations = 0;
+            for (int p = 0; p < NPHASE; ++p) {
+                allocated += s->alloc[p];
+                allocations += s->nalloc[p];
+            }
+            REAL(col)[i] = (double)(k == 0 ? s->bytes : k == 1 ? s->events
+                    : k == 2 ? allocated : allocations);
+        }
+    }
+
+    for (int p = 0; p < 2 * NPHASE; ++p) {
+        char name[32];
+        int phase = p % NPHASE;
+        bool count = p >= NPHASE;
+        SEXP col = allocVector(REALSXP, nrecords);
+        SET_VECTOR_ELT(out, NPHASE + 5 + p, col);
+        snprintf(name, sizeof(name), "%s.%s", phase_names[phase],
+                count ? "nalloc" : "alloc");
+        SET_STRING_ELT(names, NPHASE + 5 + p, mkChar(name));
+        for (int i = 0; i < nrecords; ++i) {
+            const lxb_stats *s = &records[i].stats;
+            REAL(col)[i] = (double)(count ? s->nalloc[phase]
+                    : s->alloc[phase]);
+        }
+    }
+
+    namesgets(out, names);
+    if (*LOGICAL(inReset) == TRUE)
+        clear_records();
+
+    UNPROTECT(2);
+
+    return out;
+}
@@ -0,0 +1,295 @@
+// Large file support for fseeko() on 32 bit platforms
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lxb.h"
+
+// Read the events of one LXB file a chunk at a time.
+//
+// Unlike read_lxb() this never holds more than one chunk of the DATA segment
+// in memory, so it works for files of any size.  The header and TEXT segment
+// are parsed once when the stream is opened, after which each call to
+// read_lxb_stream() reads the next chunk with fread() and decodes it with the
+// same plan (and filters) as a full read would.
+
+typedef struct {
+    FILE       *fp;
+    char       *filename;
+    map_t       txt;
+    decode_plan plan;
+    row_filter *filters;
+    int         nfilter;
+    int64_t     begin_data;
+    int         next, nevents;  // next event to read, events in file
+    char       *buf;            // holds 'chunk' events
+    int         chunk;
+} lxb_stream;
+
+static int seek_file(FILE *fp, int64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, offset, SEEK_SET);
+#else
+    return fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static int64_t file_size(FILE *fp)
+{
+#ifdef _WIN32
+    if (_fseeki64(fp, 0, SEEK_END) != 0)
+        return -1;
+    return _ftelli64(fp);
+#else
+    if (fseeko(fp, 0, SEEK_END) != 0)
+        return -1;
+    return ftello(fp);
+#endif
+}
+
+// Read and parse the header and TEXT segment of an open file without reading
+// any of the DATA segment, into a map alloc'ed from 'arena' (may be NULL).
+// Returns NULL on failure.
+map_t read_header_text(FILE *fp, fcs_header *hdr, lxb_arena *arena,
+        const char *filename, lxb_log *log)
+{
+    char head[58];
+    long n = (long)fread(head, 1, sizeof(head), fp);
+    if (!parse_header(head, n, hdr, filename, log))
+        return NULL;
+
+    long txt_size = (long)(hdr->end_text - hdr->begin_text);
+    if (!(txt_size > 0 && hdr->begin_text > 0)) {
+        lxb_warn(log, "  Bad LXB: could not locate TEXT segment in '%s'\n",
+                filename);
+        return NULL;
+    }
+
+    char *text = (char *)malloc(txt_size);
+    if (!text) {
+        lxb_warn(log, "  Out of memory reading TEXT segment of '%s'\n",
+                filename);
+        return NULL;
+    }
+
+    map_t txt = NULL;
+    if (seek_file(fp, hdr->begin_text) == 0
+            && fread(text, 1, txt_size, fp) == (size_t)txt_size) {
+        txt = parse_text(text, txt_size, arena, filename, log);
+    } else {
+        lxb_warn(log, "  Bad LXB: could not read TEXT segment in '%s'\n",
+                filename);
+    }
+    free(text);
+
+    if (txt && !check_par_format(txt, filename, log)) {
+        map_free(txt);
+        txt = NULL;
+    }
+
+    return txt;
+}
+
+// Read only the TEXT segment of 'filename', i.e. a few kB from the start of
+// the file instead of the whole file.  Does not call into R.
+map_t load_text(const char *filename, lxb_arena *arena, lxb_log *log)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        lxb_warn(log, "  Could not read file: %s\n", filename);
+        return NULL;
+    }
+
+    fcs_header hdr;
+    map_t txt = read_header_text(fp, &hdr, arena, filename, log);
+    fclose(fp);
+
+    return txt;
+}
+
+static void free_stream(lxb_stream *s)
+{
+    if (!s)
+        return;
+
+    if (s->fp)
+        fclose(s->fp);
+    free_plan(&s->plan);
+    map_free(s->txt);
+    free(s->filters);
+    free(s->buf);
+    free(s->filename);
+    free(s);
+}
+
+static void close_stream_f(SEXP ptr)
+{
+    free_stream((lxb_stream *)R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+}
+
+// Returns NULL on failure, see 'log' for why.
+static lxb_stream *open_stream(const char *filename, const lxb_opts *opts,
+        double bufsize, lxb_log *log)
+{
+    lxb_stream *s = (lxb_stream *)calloc(1, sizeof(lxb_stream));
+    if (!s) {
+        lxb_warn(log, "  Out of memory opening '%s'\n", filename);
+        return NULL;
+    }
+
+    s->filename = dup2str(filename, strlen(filename));
+    s->fp = fopen(filename, "rb");
+    if (!(s->filename && s->fp)) {
+        lxb_warn(log, "  Could not read file: %s\n", filename);
+        free_stream(s);
+        return NULL;
+    }
+
+    fcs_header hdr;
+    int64_t end_data;
+    s->txt = read_header_text(s->fp, &hdr, NULL, filename, log);
+    if (!s->txt) {
+        free_stream(s);
+        return NULL;
+    }
+    if (!locate_data(&hdr, s->txt, &s->begin_data, &end_data)) {
+        lxb_warn(log, "  Bad LXB: could not locate DATA segment in '%s'\n",
+                filename);
+        free_stream(s);
+        return NULL;
+    }
+
+    // Never read past the end of the file, even if $TOT says there is more.
+    int64_t size = data_size(s->begin_data, end_data, file_size(s->fp));
+    if (!plan_file(&s->plan, s->txt, size, opts, filename, log)) {
+        free_stream(s);
+        return NULL;
+    }
+    s->nevents = s->plan.ntot;
+
+    s->chunk = s->plan.stride > 0 ? (int)(bufsize / s->plan.stride) : 1;
+    if (s->chunk < 1)
+        s->chunk = 1;
+    if (s->chunk > s->nevents && s->nevents > 0)
+        s->chunk = s->nevents;
+
+    s->filters = (row_filter *)malloc((opts->ngates + 2) * sizeof(row_filter));
+    s->buf = (char *)malloc((size_t)s->chunk * s->plan.stride + 1);
+    if (!(s->filters && s->buf)) {
+        lxb_warn(log, "  Out of memory opening '%s'\n", filename);
+        free_stream(s);
+        return NULL;
+    }
+    s->nfilter = select_filters(&s->plan, opts, s->filters, filename, log);
+
+    return s;
+}
+
+// Open 'inFilename' for reading with read_lxb_stream().  The columns, filter
+// and gates are the same as for read_lxb(), 'inBufSize' is the (approximate)
+// number of bytes of DATA to read at a time.
+//
+// Returns an external pointer, or NULL if the file could not be opened.
+SEXP open_lxb_stream(SEXP inFilename, SEXP inColumns, SEXP inFilter,
+        SEXP inGates, SEXP inBufSize)
+{
+    const char *filename = CHAR(STRING_ELT(inFilename, 0));
+    lxb_opts opts;
+    get_opts(&opts, inColumns, inFilter, inGates);
+
+    lxb_log log = { 0 };
+    lxb_stream *s = open_stream(filename, &opts, *REAL(inBufSize), &log);
+    flush_log(&log);
+    if (!s)
+        return R_NilValue;
+
+    SEXP ptr;
+    PROTECT(ptr = R_MakeExternalPtr(s, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, close_stream_f, TRUE);
+    UNPROTECT(1);
+
+    return ptr;
+}
+
+// Read the next 'inCount' events (fewer at the end of the file or if events
+// are filtered out).  Returns a matrix like read_lxb() does, or NULL once all
+// events have been read.
+SEXP read_lxb_stream(SEXP inStream, SEXP inCount)
+{
+    lxb_stream *s = (lxb_stream *)R_ExternalPtrAddr(inStream);
+    if (!s) {
+        warning("LXB stream is closed");
+        return R_NilValue;
+    }
+
+    int n = s->nevents - s->next;
+    if (*INTEGER(inCount) < n)
+        n = *INTEGER(inCount);
+    if (n <= 0)
+        return R_NilValue;
+
+    SEXP mat;
+    PROTECT(mat = alloc_matrix(&s->plan, n));
+    void *dest = s->plan.real ? (void *)REAL(mat) : (void *)INTEGER(mat);
+
+    // Each chunk is decoded into the rows following the previous chunk.
+    bool ok = seek_file(s->fp, s->begin_data
+            + (int64_t)s->next * s->plan.stride) == 0;
+    int nrow = 0;
+    for (int left = n; ok && left > 0; ) {
+        int m = left < s->chunk ? left : s->chunk;
+        size_t bytes = (size_t)m * s->plan.stride;
+        if (fread(s->buf, 1, bytes, s->fp) != bytes) {
+            ok = false;
+            break;
+        }
+
+        decode_plan chunk = s->plan;
+        chunk.ntot = chunk.nrow = m;
+        chunk.ld = n;
+        if (!filter_rows(&chunk, s->buf, s->filters, s->nfilter)) {
+            ok = false;
+            break;
+        }
+        copy_data(output_at(dest, &chunk, nrow), s->buf, &chunk);
+        free_rows(&chunk);
+
+        nrow += chunk.nrow;
+        s->next += m;
+        left -= m;
+    }
+
+    if (!ok) {
+        // Do not try again, this is most likely a truncated file.
+        warning("Failed reading events %d to %d from '%s'\n",
+                s->next + 1, s->next + n, s->filename);
+        s->nevents = s->next;
+    }
+
+    if (nrow < n) {
+        // Some events were filtered out, shrink output to fit.
+        SEXP out;
+        PROTECT(out = alloc_matrix(&s->plan, nrow));
+        void *to = s->plan.real ? (void *)REAL(out) : (void *)INTEGER(out);
+        for (int i = 0; i < s->plan.ncol; ++i)
+            memcpy(output_at(to, &s->plan, (size_t)i*nrow),
+                    output_at(dest, &s->plan, (size_t)i*n),
+                    nrow * output_size(&s->plan));
+        UNPROTECT(2);
+        return out;
+    }
+
+    UNPROTECT(1);
+
+    return mat;
+}
+
+// Close the file now rather than when the stream is garbage collected.
+SEXP close_lxb_stream(SEXP inStream)
+{
+    close_stream_f(inStream);
+    return R_NilValue;
+}
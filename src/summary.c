@@ -0,0 +1,569 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lxb.h"
+
+// Summarizing the events of each file by bead region (RID) as they are
+// decoded, without ever building the event matrix.
+//
+// The events are decoded a chunk at a time, in one pass over the DATA
+// segment, and each parameter of each region keeps a running sum (for the
+// mean) and what its median needs.  Integer parameters with a $PnR of at most
+// 65536 (such as the usual 16 bit reporters) count their values in a
+// histogram of that many bins, and the median is read off its cumulative
+// counts.  As long as a region has fewer events than that its histogram would
+// be mostly empty, so until its values take as much room as the histogram
+// they are buffered instead (in 1 or 2 bytes each).  So memory is bounded by
+// the ranges of the parameters of each region rather than by the number of
+// events.  Only floating point parameters and wider ranges have no histogram:
+// their values are buffered (as doubles or ints) and the median is a
+// selection over them.  The output is a few values per region.
+
+// Events decoded at a time (per thread).
+#define SUMMARY_CHUNK 4096
+// Largest RID handled, LXB files use 0 to 500.
+#define MAX_RID 65535
+// Most bins of a histogram, the $PnR of a 16 bit parameter.
+#define MAX_BINS 65536
+
+// Summary of one file, 'nstat' values per region for each statistic.
+typedef struct {
+    int     nregion;
+    int    *rid;            // of each region, in increasing order
+    int    *count;          // events in each region
+    double *median, *mean;  // [nstat][nregion]
+} file_summary;
+
+// How the values of one parameter are kept, see column_kinds().
+typedef struct {
+    int width;              // bytes per buffered value
+    int nbin;               // bins of its histogram, 0 if it has none
+} column_kind;
+
+// The values of one parameter of one region: buffered in 'vals' until they
+// take as much room as a histogram, then counted in 'hist' (if the parameter
+// has one, see grow_values()).
+typedef struct {
+    int          n, cap;    // values buffered, and room for
+    char        *vals;
+    uint32_t    *hist;      // [nbin], 'vals' is NULL once it is used
+    long double  sum;       // of all values
+} column_values;
+
+// The events of one region: how many, and the values of each parameter.
+typedef struct {
+    int            n;
+    column_values *col;     // [nstat]
+} region_values;
+
+static void free_summary(file_summary *s)
+{
+    free(s->rid);
+    free(s->count);
+    free(s->median);
+    free(s->mean);
+    memset(s, 0, sizeof(*s));
+}
+
+static void free_region(region_values *r, int nstat)
+{
+    for (int c = 0; r->col && c < nstat; ++c) {
+        free(r->col[c].vals);
+        free(r->col[c].hist);
+    }
+    free(r->col);
+}
+
+// Partially sort 'x' so that x[k] is the value it would have if all 'n'
+// values were sorted: x[i] <= x[k] <= x[j] for any i < k < j.
+static void select_nth(double *x, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        // Median of three as the pivot makes sorted input cheap too.
+        double a = x[lo], b = x[lo + (hi - lo) / 2], c = x[hi];
+        double pivot = a < b ? (b < c ? b : (a < c ? c : a))
+                             : (a < c ? a : (b < c ? c : b));
+
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (x[i] < pivot)
+                ++i;
+            while (x[j] > pivot)
+                --j;
+            if (i <= j) {
+                double t = x[i];
+                x[i++] = x[j];
+                x[j--] = t;
+            }
+        }
+
+        // Now x[lo..j] <= pivot <= x[i..hi] and anything in between equals
+        // the pivot.
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            return;
+    }
+}
+
+// Median of the 'n' > 0 values in 'x' (which are reordered), the same as R's
+// median() including the mean of the two middle values if 'n' is even.
+static double median_of(double *x, int n)
+{
+    int k = (n - 1) / 2;
+    select_nth(x, n, k);
+    if (n % 2)
+        return x[k];
+
+    double next = x[k + 1];
+    for (int i = k + 2; i < n; ++i) {
+        if (x[i] < next)
+            next = x[i];
+    }
+    return (x[k] + next) / 2;
+}
+
+// Same as median_of() for the 'n' > 0 values counted in 'hist', where bin b
+// counts the values equal to b.
+static double hist_median(const uint32_t *hist, int n)
+{
+    // Bin b holds the values ranked 'seen' to 'seen' + hist[b] - 1.
+    int64_t k = (n - 1) / 2, seen = 0;
+    int b = 0;
+    while (seen + hist[b] <= k)
+        seen += hist[b++];
+    if (n % 2 || seen + hist[b] > k + 1)
+        return b;
+
+    // The value ranked k + 1 is in the next bin that is not empty.
+    int next = b + 1;
+    while (!hist[next])
+        ++next;
+    return (b + next) / 2.0;
+}
+
+// How each of the 'nstat' columns of 'plan' other than 'rid_col' is kept:
+// integers in as few bytes as their mask needs, with a histogram if that has
+// at most MAX_BINS bins, and floating point values as doubles.
+static void column_kinds(const decode_plan *plan, int rid_col,
+        column_kind *kind)
+{
+    for (int k = 0, c = 0; k < plan->ncol; ++k) {
+        if (k == rid_col)
+            continue;
+        unsigned mask = plan->mask[k];
+        kind[c].width = plan->real ? (int)sizeof(double)
+            : mask <= 0xff ? 1 : mask <= 0xffff ? 2 : (int)sizeof(int);
+        kind[c].nbin = !plan->real && mask < MAX_BINS ? (int)mask + 1 : 0;
+        ++c;
+    }
+}
+
+// Value 'j' of the 'width' byte values at 'p'.
+static double get_value(const char *p, int width, int j)
+{
+    switch (width) {
+    case 1:
+        return ((const uint8_t *)p)[j];
+    case 2:
+        return ((const uint16_t *)p)[j];
+    case sizeof(int):
+        return ((const int *)p)[j];
+    default:
+        return ((const double *)p)[j];
+    }
+}
+
+// Make room for more values in 'v' of kind 'kind', at most 'max' in all:
+// twice as many, or a histogram instead if the parameter has one and it would
+// take no more room.  The allocation is counted in 'nalloc' and 'alloced'.
+// Returns false if out of memory.
+static bool grow_values(column_values *v, const column_kind *kind, int max,
+        int64_t *nalloc, int64_t *alloced)
+{
+    int64_t cap = v->cap > 0 ? 2 * (int64_t)v->cap : 16;
+    if (cap > max)
+        cap = max;
+
+    size_t hist_size = (size_t)kind->nbin * sizeof(uint32_t);
+    if (kind->nbin > 0 && (size_t)cap * kind->width >= hist_size) {
+        uint32_t *hist = (uint32_t *)calloc(kind->nbin, sizeof(uint32_t));
+        if (!hist)
+            return false;
+        for (int j = 0; j < v->n; ++j)
+            ++hist[(int)get_value(v->vals, kind->width, j)];
+        free(v->vals);
+        v->vals = NULL;
+        v->hist = hist;
+        v->n = v->cap = 0;
+        *nalloc += 1;
+        *alloced += hist_size;
+        return true;
+    }
+
+    char *vals = (char *)realloc(v->vals, (size_t)cap * kind->width);
+    if (!vals)
+        return false;
+    v->vals = vals;
+    v->cap = (int)cap;
+    *nalloc += 1;
+    *alloced += cap * kind->width;
+    return true;
+}
+
+// Add 'x' to the values 'v' of kind 'kind', see grow_values().  Integers are
+// narrowed to the width of their column, which their mask guarantees they
+// fit.  Returns false if out of memory.
+static bool add_value(column_values *v, const column_kind *kind, double x,
+        int max, int64_t *nalloc, int64_t *alloced)
+{
+    v->sum += x;
+    if (!v->hist && v->n == v->cap
+            && !grow_values(v, kind, max, nalloc, alloced))
+        return false;
+
+    if (v->hist) {
+        ++v->hist[(int)x];
+        return true;
+    }
+
+    char *dst = v->vals + (size_t)v->n++ * kind->width;
+    switch (kind->width) {
+    case 1:
+        *(uint8_t *)dst = (uint8_t)x;
+        break;
+    case 2:
+        *(uint16_t *)dst = (uint16_t)x;
+        break;
+    case sizeof(int):
+        *(int *)dst = (int)x;
+        break;
+    default:
+        *(double *)dst = x;
+        break;
+    }
+    return true;
+}
+
+// Summarize the events of 'f' by the RID in column 'rid_col' of its plan, for
+// its other columns.  Returns false (with a warning in 'f->log') on failure.
+static bool summarize_file(lxb_file *f, int rid_col, file_summary *s)
+{
+    const decode_plan *plan = &f->plan;
+    int nrow = plan->nrow, ncol = plan->ncol, nstat = ncol - 1;
+    bool real = plan->real;
+
+    // Region of each RID (plus one, 0 if none yet) and the regions in the
+    // order they were found.  Integer RIDs are at most their mask.
+    int max_rid = real || plan->mask[rid_col] > MAX_RID ? MAX_RID
+        : (int)plan->mask[rid_col];
+    int *slot = (int *)calloc(max_rid + 1, sizeof(int));
+    int max_reg = 64;
+    region_values *reg = (region_values *)malloc(max_reg
+            * sizeof(region_values));
+    column_kind *kind = (column_kind *)malloc((ncol + 1)
+            * sizeof(column_kind));
+    char *chunk = (char *)malloc((size_t)SUMMARY_CHUNK * ncol
+            * output_size(plan));
+    bool ok = slot && reg && kind && chunk, bad_rid = false;
+    int64_t nalloced = 4, alloced = (int64_t)(max_rid + 1) * sizeof(int)
+        + max_reg * sizeof(region_values) + (ncol + 1) * sizeof(column_kind)
+        + (int64_t)SUMMARY_CHUNK * ncol * output_size(plan);
+    if (ok)
+        column_kinds(plan, rid_col, kind);
+    int nreg = 0, lo = max_rid, hi = 0;
+
+    double t = stats_start();
+    for (int start = 0; ok && start < nrow; start += SUMMARY_CHUNK) {
+        // Decode the next events as if they were all there is.
+        decode_plan part = *plan;
+        const char *src = f->data;
+        part.nrow = nrow - start < SUMMARY_CHUNK ? nrow - start
+            : SUMMARY_CHUNK;
+        part.ld = 0;
+        if (plan->rows)
+            part.rows = plan->rows + start;
+        else
+            src += (size_t)start * plan->stride;
+        copy_data(chunk, src, &part);
+
+        int m = part.nrow;
+        const double *dchunk = (const double *)chunk;
+        const int *ichunk = (const int *)chunk;
+        for (int j = 0; ok && j < m; ++j) {
+            double v = real ? dchunk[(size_t)rid_col * m + j]
+                : ichunk[(size_t)rid_col * m + j];
+            if (!(v >= 0 && v <= max_rid && v == (int)v)) {
+                ok = false;
+                bad_rid = true;
+                break;
+            }
+
+            int rid = (int)v;
+            if (!slot[rid] && nreg == max_reg) {
+                region_values *more = (region_values *)realloc(reg,
+                        2 * max_reg * sizeof(region_values));
+                ok = more != NULL;
+                if (!ok)
+                    break;
+                reg = more;
+                alloced += max_reg * sizeof(region_values);
+                ++nalloced;
+                max_reg *= 2;
+            }
+            if (!slot[rid]) {
+                reg[nreg].n = 0;
+                reg[nreg].col = (column_values *)calloc(nstat + 1,
+                        sizeof(column_values));
+                ok = reg[nreg].col != NULL;
+                if (!ok)
+                    break;
+                alloced += (nstat + 1) * sizeof(column_values);
+                ++nalloced;
+                slot[rid] = ++nreg;
+                lo = rid < lo ? rid : lo;
+                hi = rid > hi ? rid : hi;
+            }
+
+            region_values *r = &reg[slot[rid] - 1];
+            for (int k = 0, c = 0; ok && k < ncol; ++k) {
+                if (k == rid_col)
+                    continue;
+                size_t at = (size_t)k * m + j;
+                ok = add_value(&r->col[c], &kind[c],
+                        real ? dchunk[at] : ichunk[at], nrow, &nalloced,
+                        &alloced);
+                ++c;
+            }
+            ++r->n;
+        }
+    }
+
+    // Copy of the buffered values of one column of one region, for the
+    // median.
+    int most = 0;
+    for (int g = 0; ok && g < nreg; ++g) {
+        for (int c = 0; c < nstat; ++c) {
+            if (reg[g].col[c].n > most)
+                most = reg[g].col[c].n;
+        }
+    }
+    double *x = NULL;
+    if (ok) {
+        s->nregion = nreg;
+        s->rid    = (int *)malloc((nreg + 1) * sizeof(int));
+        s->count  = (int *)malloc((nreg + 1) * sizeof(int));
+        s->median = (double *)malloc(((size_t)nstat * nreg + 1)
+                * sizeof(double));
+        s->mean   = (double *)malloc(((size_t)nstat * nreg + 1)
+                * sizeof(double));
+        x = (double *)malloc(((size_t)most + 1) * sizeof(double));
+        ok = s->rid && s->count && s->median && s->mean && x;
+        alloced += (int64_t)(most + 1) * sizeof(double);
+        nalloced += 5;
+    }
+
+    for (int rid = lo, g = 0; ok && rid <= hi; ++rid) {
+        if (!slot[rid])
+            continue;
+        const region_values *r = &reg[slot[rid] - 1];
+        int n = r->n;
+
+        s->rid[g] = rid;
+        s->count[g] = n;
+        for (int c = 0; c < nstat; ++c) {
+            const column_values *v = &r->col[c];
+            size_t at = (size_t)c * nreg + g;
+            s->mean[at] = (double)(v->sum / n);
+            if (v->hist) {
+                s->median[at] = hist_median(v->hist, n);
+                continue;
+            }
+
+            bool nan = false;
+            for (int j = 0; j < n; ++j) {
+                x[j] = get_value(v->vals, kind[c].width, j);
+                nan |= ISNAN(x[j]);
+            }
+            s->median[at] = nan ? NA_REAL : median_of(x, n);
+        }
+        ++g;
+    }
+    stats_stop(&f->stats, PHASE_DECODE, t);
+    stats_alloc(&f->stats, PHASE_DECODE, nalloced, alloced);
+    f->stats.events += nrow;
+
+    if (bad_rid)
+        lxb_warn(&f->log, "  Bead regions (RID) of '%s' out of range, "
+                "skipped\n", f->filename);
+    else if (!ok)
+        lxb_warn(&f->log, "  Out of memory summarizing '%s'\n", f->filename);
+    if (!ok)
+        free_summary(s);
+    for (int g = 0; reg && g < nreg; ++g)
+        free_region(&reg[g], nstat);
+    free(slot);
+    free(reg);
+    free(kind);
+    free(chunk);
+    free(x);
+
+    return ok;
+}
+
+// Column of 'plan' holding the RID, or -1 if there is none.
+static int rid_column(const decode_plan *plan)
+{
+    for (int k = 0; k < plan->ncol; ++k) {
+        if (strcmp(plan->par[plan->col[k]].name, "RID") == 0)
+            return k;
+    }
+    return -1;
+}
+
+// Summarize many LXB files by bead region, e.g. all wells of a plate.
+//
+// Returns a named list of columns with one row per region of each file, with
+// files ordered by well as for read_lxb_batch(): 'well', 'RID', 'count' and
+// then '<name>.median' and '<name>.mean' for each decoded parameter other
+// than RID.  'inColumns', 'inFilter' and 'inGates' select the parameters and
+// events as for read_lxb(), RID is always decoded.  Files with other columns
+// than the first file are skipped with a warning.  At most 'inThreads'
+// threads are used if it is not NULL.
+//
+// Returns NULL if no file could be read.
+SEXP summarize_lxb(SEXP inFilenames, SEXP inColumns, SEXP inFilter,
+        SEXP inGates, SEXP inThreads)
+{
+    int n = LENGTH(inFilenames);
+    lxb_opts opts;
+    get_opts(&opts, inColumns, inFilter, inGates);
+    opts.threads = threads_arg(inThreads);
+    if (opts.ncolumns >= 0) {
+        const char **columns = (const char **)R_alloc(opts.ncolumns + 2,
+                sizeof(const char *));
+        int ncolumns = 0;
+        columns[ncolumns++] = "RID";
+        for (int k = 0; k < opts.ncolumns; ++k) {
+            if (strcmp(opts.columns[k], "RID") != 0)
+                columns[ncolumns++] = opts.columns[k];
+        }
+        opts.columns = columns;
+        opts.ncolumns = ncolumns;
+    }
+
+    lxb_file *files = (lxb_file *)R_alloc(n + 1, sizeof(lxb_file));
+    file_summary *sums = (file_summary *)R_alloc(n + 1, sizeof(file_summary));
+    int *rid_col = (int *)R_alloc(n + 1, sizeof(int));
+    memset(files, 0, n * sizeof(lxb_file));
+    memset(sums, 0, n * sizeof(file_summary));
+    for (int i = 0; i < n; ++i)
+        files[i].filename = CHAR(STRING_ELT(inFilenames, i));
+
+    reset_arenas();
+    load_files(files, n, &opts);
+
+    int *pos = (int *)R_alloc(n + 1, sizeof(int));
+    const char **filenames = (const char **)R_alloc(n + 1, sizeof(char *));
+    const char **ids = (const char **)R_alloc(n + 1, sizeof(char *));
+    for (int i = 0; i < n; ++i) {
+        filenames[i] = files[i].filename;
+        ids[i] = file_well_id(&files[i]);
+    }
+    SEXP names;
+    PROTECT(names = well_names(filenames, ids, n, pos));
+
+    // Only summarize files with the columns of the first file.
+    const decode_plan *ref = NULL;
+    for (int k = 0; k < n; ++k) {
+        lxb_file *f = &files[pos[k]];
+        rid_col[pos[k]] = f->data ? rid_column(&f->plan) : -1;
+        if (f->data && rid_col[pos[k]] < 0) {
+            lxb_warn(&f->log, "  No bead regions (RID) in '%s', skipped\n",
+                    f->filename);
+            f->data = NULL;
+        }
+        if (f->data && !ref)
+            ref = &f->plan;
+        if (f->data && !same_columns(ref, &f->plan)) {
+            lxb_warn(&f->log, "  Columns of '%s' do not match those of "
+                    "the first file, skipped\n", f->filename);
+            f->data = NULL;
+        }
+    }
+
+#pragma omp parallel for schedule(dynamic) num_threads(thread_count(&opts))
+    for (int i = 0; i < n; ++i) {
+        lxb_file *f = &files[i];
+        if (f->data && !summarize_file(f, rid_col[i], &sums[i]))
+            f->data = NULL;
+    }
+
+    R_xlen_t nrow = 0;
+    for (int k = 0; k < n; ++k) {
+        flush_log(&files[pos[k]].log);
+        if (files[pos[k]].data)
+            nrow += sums[pos[k]].nregion;
+    }
+
+    SEXP out = R_NilValue;
+    if (ref) {
+        int ncol = ref->ncol - 1, rc = rid_column(ref);
+        SEXP outnames;
+        PROTECT(out = allocVector(VECSXP, 3 + 2 * ncol));
+        PROTECT(outnames = allocVector(STRSXP, 3 + 2 * ncol));
+
+        SEXP well, rid, count;
+        SET_VECTOR_ELT(out, 0, well = allocVector(STRSXP, nrow));
+        SET_VECTOR_ELT(out, 1, rid = allocVector(INTSXP, nrow));
+        SET_VECTOR_ELT(out, 2, count = allocVector(INTSXP, nrow));
+        SET_STRING_ELT(outnames, 0, mkChar("well"));
+        SET_STRING_ELT(outnames, 1, mkChar("RID"));
+        SET_STRING_ELT(outnames, 2, mkChar("count"));
+        for (int k = 0, c = 0; k < ref->ncol; ++k) {
+            if (k == rc)
+                continue;
+            const char *name = ref->par[ref->col[k]].name;
+            char buf[MAX_MSG_LEN];
+            snprintf(buf, sizeof(buf), "%s.median", name);
+            SET_STRING_ELT(outnames, 3 + 2 * c, mkChar(buf));
+            snprintf(buf, sizeof(buf), "%s.mean", name);
+            SET_STRING_ELT(outnames, 4 + 2 * c, mkChar(buf));
+            SET_VECTOR_ELT(out, 3 + 2 * c, allocVector(REALSXP, nrow));
+            SET_VECTOR_ELT(out, 4 + 2 * c, allocVector(REALSXP, nrow));
+            ++c;
+        }
+        namesgets(out, outnames);
+
+        R_xlen_t row = 0;
+        for (int k = 0; k < n; ++k) {
+            const file_summary *s = &sums[pos[k]];
+            if (!files[pos[k]].data)
+                continue;
+            for (int g = 0; g < s->nregion; ++g, ++row) {
+                SET_STRING_ELT(well, row, STRING_ELT(names, pos[k]));
+                INTEGER(rid)[row] = s->rid[g];
+                INTEGER(count)[row] = s->count[g];
+                for (int c = 0; c < ncol; ++c) {
+                    size_t at = (size_t)c * s->nregion + g;
+                    REAL(VECTOR_ELT(out, 3 + 2 * c))[row] = s->median[at];
+                    REAL(VECTOR_ELT(out, 4 + 2 * c))[row] = s->mean[at];
+                }
+            }
+        }
+        UNPROTECT(2);
+    }
+
+    for (int i = 0; i < n; ++i) {
+        free_summary(&sums[i]);
+        free_file(&files[i]);
+    }
+    stats_record(files, n);
+    UNPROTECT(1);
+
+    return out;
+}
@@ -0,0 +1,191 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lxb.h"
+
+// Naming and ordering files by the well of the plate they were read from.
+//
+// The well of a file is given by its $WELLID keyword (FCS 3.1), e.g. "B7" or
+// "AF12", or else by its name if that ends in a letter and a column number
+// followed by ".lxb", e.g. "Plate1_B07.lxb".  Files are only named by well if
+// the wells of all files are known, in which case they are listed by column
+// (A1, B1, ..., A2, B2, ...), otherwise they are named by file and listed in
+// the order given.
+
+typedef struct {
+    char row[3];        // one or two letters, NUL terminated
+    int  col;
+    int  index;         // of the file, keeps the sort stable
+} well_t;
+
+// Parse a 1-9 digit column number at 's'.  Returns the number of digits.
+static int parse_column(const char *s, int *col)
+{
+    int n = 0;
+    *col = 0;
+    while (n < 9 && isdigit((unsigned char)s[n]))
+        *col = 10 * *col + (s[n++] - '0');
+    return isdigit((unsigned char)s[n]) ? 0 : n;
+}
+
+// Parse a $WELLID value: an optional blank, one or two letters, and a
+// column number.
+static bool parse_well_id(const char *s, well_t *w)
+{
+    while (*s == ' ')
+        ++s;
+
+    int n = 0;
+    while (n < 2 && isalpha((unsigned char)s[n])) {
+        w->row[n] = s[n];
+        ++n;
+    }
+    w->row[n] = 0;
+
+    int ndigits = n > 0 ? parse_column(s + n, &w->col) : 0;
+    if (ndigits == 0)
+        return false;
+
+    for (s += n + ndigits; *s == ' '; ++s)
+        ;
+    return *s == 0;
+}
+
+// Parse the well from the last "<letter><digits>.lxb" in 'path' (one letter
+// only, since a name such as "PlateAB3.lxb" is more likely to be well B3).
+static bool parse_well_filename(const char *path, well_t *w)
+{
+    size_t len = strlen(path);
+    for (const char *p = path + (len > 4 ? len - 4 : 0); p > path; --p) {
+        if (memcmp(p, ".lxb", 4) != 0)
+            continue;
+
+        const char *q = p;
+        while (q > path && isdigit((unsigned char)q[-1]))
+            --q;
+        if (q == p || q == path || !isalpha((unsigned char)q[-1]))
+            continue;
+        if (parse_column(q, &w->col) != p - q)
+            continue;
+
+        w->row[0] = q[-1];
+        w->row[1] = 0;
+        return true;
+    }
+
+    return false;
+}
+
+// Rows in plate order: A, ..., Z, AA, ..., and upper before lower case.
+static int compare_rows(const char *a, const char *b)
+{
+    size_t na = strlen(a), nb = strlen(b);
+    if (na != nb)
+        return na < nb ? -1 : 1;
+
+    for (size_t k = 0; k < na; ++k) {
+        int ca = toupper((unsigned char)a[k]);
+        int cb = toupper((unsigned char)b[k]);
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+    return strcmp(a, b);
+}
+
+static int compare_wells(const void *pa, const void *pb)
+{
+    const well_t *a = (const well_t *)pa, *b = (const well_t *)pb;
+    if (a->col != b->col)
+        return a->col < b->col ? -1 : 1;
+
+    int c = compare_rows(a->row, b->row);
+    if (c != 0)
+        return c;
+    return a->index < b->index ? -1 : a->index > b->index;
+}
+
+// Name of 'path' without directory and ".lxb".
+static SEXP file_name(const char *path)
+{
+    const char *base = path;
+    for (const char *p = path; *p; ++p) {
+#ifdef _WIN32
+        if (*p == '\\')
+            base = p + 1;
+#endif
+        if (*p == '/')
+            base = p + 1;
+    }
+
+    const char *ext = strstr(base, ".lxb");
+    size_t len = ext ? (size_t)(ext - base) : strlen(base);
+    return mkCharLen(base, (int)len);
+}
+
+SEXP well_names(const char **filenames, const char **ids, int n, int *order)
+{
+    well_t *wells = (well_t *)R_alloc(n > 0 ? n : 1, sizeof(well_t));
+    bool all_wells = true;
+    for (int i = 0; i < n && all_wells; ++i) {
+        wells[i].index = i;
+        all_wells = (ids && ids[i] && parse_well_id(ids[i], &wells[i]))
+            || parse_well_filename(filenames[i], &wells[i]);
+    }
+
+    SEXP names;
+    PROTECT(names = allocVector(STRSXP, n));
+    if (all_wells) {
+        char buf[16];
+        for (int i = 0; i < n; ++i) {
+            snprintf(buf, sizeof(buf), "%s%d", wells[i].row, wells[i].col);
+            SET_STRING_ELT(names, i, mkChar(buf));
+        }
+
+        qsort(wells, n, sizeof(well_t), compare_wells);
+        for (int i = 0; i < n; ++i)
+            order[i] = wells[i].index;
+    } else {
+        for (int i = 0; i < n; ++i) {
+            SET_STRING_ELT(names, i, file_name(filenames[i]));
+            order[i] = i;
+        }
+    }
+
+    UNPROTECT(1);
+
+    return names;
+}
+
+// Well (or file) names of 'inFilenames' and the order to list them in, given
+// the $WELLID of each file in 'inWellIds' (NA if unknown, or NULL if none are
+// known).  Returns list(names=, order=) with 1-based 'order'.
+SEXP order_lxb_wells(SEXP inFilenames, SEXP inWellIds)
+{
+    int n = LENGTH(inFilenames);
+    const char **filenames = (const char **)R_alloc(n + 1, sizeof(char *));
+    const char **ids = (const char **)R_alloc(n + 1, sizeof(char *));
+    for (int i = 0; i < n; ++i) {
+        filenames[i] = CHAR(STRING_ELT(inFilenames, i));
+        SEXP id = isNull(inWellIds) ? NA_STRING : STRING_ELT(inWellIds, i);
+        ids[i] = id == NA_STRING ? NULL : CHAR(id);
+    }
+
+    int *order = (int *)R_alloc(n + 1, sizeof(int));
+    SEXP out, outnames, names, ord;
+    PROTECT(names = well_names(filenames, ids, n, order));
+    PROTECT(ord = allocVector(INTSXP, n));
+    for (int i = 0; i < n; ++i)
+        INTEGER(ord)[i] = order[i] + 1;
+
+    PROTECT(out = allocVector(VECSXP, 2));
+    PROTECT(outnames = allocVector(STRSXP, 2));
+    SET_VECTOR_ELT(out, 0, names);
+    SET_VECTOR_ELT(out, 1, ord);
+    SET_STRING_ELT(outnames, 0, mkChar("names"));
+    SET_STRING_ELT(outnames, 1, mkChar("order"));
+    namesgets(out, outnames);
+    UNPROTECT(4);
+
+    return out;
+}